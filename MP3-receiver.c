@@ -11,8 +11,34 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <pthread.h>
+#include <time.h>
+#include <zlib.h>
 
 #include "helper.h"
+#include "delta.h"
+#include "ring.h"
+#include "tune.h"
+
+/* Threads inflating compressed segments before they are written */
+#define DECOMPRESS_THREADS 2
+
+/* Seconds between syncs of the partial file and its received block map */
+#define RESUME_SYNC_INTERVAL 1
+#define RESUME_MAP_MAGIC "RUDPMAP1"
+
+/* One cumulative ACK every ACK_EVERY written segments or ACK_DELAY microseconds */
+#define ACK_EVERY 16
+#define ACK_DELAY 1000
+
+/* A hole is reported again if its repair hasn't come after this many microseconds */
+#define NAK_INTERVAL 2000
+
+/* Tag of the batched destination write in the writer's ring */
+#define RING_WRITE 2
+
+/* Once done, how long to wait for the sender's CLOSE before repeating the FIN_ACK */
+#define FIN_LINGER 200000
+#define FIN_RETRIES 5
 
 void reliablyReceive(unsigned short int myUDPport, char* destinationFile);
 int establish_receive_connection();
@@ -21,13 +47,87 @@ int write_to_file();
 void initialize_window();
 int map_seq_to_window(int seq);
 int receivePacket(int sockfd);
+int handle_packet(unsigned char *buf, int numbytes);
+int receive_with_ring();
+void ack_segment(int seq);
+void flush_batch();
+void ack_written();
+void send_nak();
+int skip_expired(long long int now, long long int *next_expiry);
+void skip_segment(int seq);
+void send_skipped();
 void *write_handler(void *datapv);
+void *decompress_segments(void *data);
+void send_signatures(int chunk);
+void copy_basis_blocks(unsigned char *ref);
+void send_ranges(int chunk, long long size, long long mtime);
+void send_message(void *data, int size);
+void save_received_map();
+void finish_destination();
+void start_message(unsigned char **data, int *size);
 
 struct sockaddr_storage their_addr;
 
 char* sender_host_name = NULL;
 int done = 0 ;
 int send_sock;
+char *destination_name;
+int transfer_complete = 0;
+int fin_retries = 0;
+
+/*
+*   io_uring, -u: the main thread receives through a multishot receive, the
+*   writer submits a batch's destination write and ACKs together
+*/
+int ring_enabled = 0;
+int low_latency = 0;
+struct Ring recv_ring;
+struct Ring write_ring;
+int write_ring_state = 0;	/* 1 ready, -1 unavailable, 0 not tried yet */
+struct iovec batch_iov[WINDOW_SIZE];
+unsigned char *batch_data[WINDOW_SIZE];
+int batch_count = 0;
+size_t batch_bytes = 0;
+int batch_acks[WINDOW_SIZE];
+struct iovec batch_ack_iov[WINDOW_SIZE];
+struct msghdr batch_msgs[WINDOW_SIZE];
+int batch_ack_count = 0;
+
+/* Delayed ACKs, guarded by window_lock */
+int ack_every = ACK_EVERY;
+long long int ack_delay = ACK_DELAY;
+int unacked = 0;
+long long int unacked_since = 0;
+int ack_now = 0;
+int acks_sent = 0;
+int segments_written = 0;
+int naks_sent = 0;
+int highest_seq = -1;
+
+/*
+*   Partial reliability, -e: a hole missing for this many microseconds is
+*   skipped and the data behind it delivered. 0 waits for every segment.
+*/
+long long int deadline_us = 0;
+int segments_skipped = 0;
+int skipped_seqs[WINDOW_SIZE];
+int skipped_pending = 0;
+
+/* Percentage of incoming datagrams dropped on purpose, -x, to test loss recovery */
+int drop_percent = 0;
+
+/* Multicast group joined on the interface of address multicast_if, -g and -i */
+char *multicast_group = NULL;
+char *multicast_if = NULL;
+
+/* Sessions deliver each message as a file of the destination directory */
+char *message_dir = NULL;
+int messages_received = 0;
+/* A skipped segment cut the current message short, -e */
+int message_lost = 0;
+char message_name[NAME_MAX + 1];
+/* Bytes delivered to the current file, where a skipped segment leaves its gap */
+long long int output_offset = 0;
 
 struct window_slot{
      int ack;
@@ -35,6 +135,11 @@ struct window_slot{
      int received;
      int seq;
      int size;
+     int decoded;
+     int flags;
+     long long int nak_time;
+     long long int missing_since;	/* when a later segment showed the hole */
+     int skipped;
      unsigned char *data;
 };
 
@@ -48,6 +153,38 @@ struct addrinfo *client_info;
 FILE *file;
 pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t window_cond = PTHREAD_COND_INITIALIZER;
+
+/* Seqs of stored segments waiting to be decompressed, guarded by window_lock */
+int decode_queue[WINDOW_SIZE];
+int decode_head = 0;
+int decode_count = 0;
+pthread_cond_t decode_cond = PTHREAD_COND_INITIALIZER;
+
+/* Existing copy of the destination, the basis of delta transfers */
+FILE *basis = NULL;
+char *partial_name = NULL;
+struct BlockSignature *signatures = NULL;
+int basis_blocks = -1;
+int basis_block_size = DELTA_MIN_BLOCK;
+unsigned long long int bytes_reused = 0;
+
+/*
+*   Resumable transfers. Blocks written to the partial file are marked in
+*   received_map, persisted in map_name once the data is on disk. Segment
+*   seq i carries block missing_blocks[i].
+*/
+int resumable = 0;
+char *map_name = NULL;
+int map_fd = -1;
+long long int resume_size;
+long long int resume_mtime;
+int map_blocks = 0;
+int map_bytes = 0;
+unsigned char *received_map = NULL;
+int *missing_blocks = NULL;
+int missing_count = 0;
+time_t last_sync = 0;
 int next_slot = 0;
 int available_slots = 0;
 int next_expected_packet;
@@ -71,11 +208,60 @@ int window_has_room() {
 
 int main(int argc, char** argv) {
 	unsigned short int udpPort;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ua:t:e:x:N:D:lg:i:")) != -1) {
+		switch (opt) {
+		case 'u':
+			ring_enabled = 1;
+			break;
+		case 'a':
+			ack_every = atoi(optarg);
+			break;
+		case 't':
+			ack_delay = atoll(optarg);
+			break;
+		case 'e':
+			deadline_us = atoll(optarg) * 1000;
+			break;
+		case 'x':
+			drop_percent = atoi(optarg);
+			break;
+		case 'N':
+			set_thread_cpus(NET_THREADS, optarg, "reliable_receiver");
+			break;
+		case 'D':
+			set_thread_cpus(DISK_THREADS, optarg, "reliable_receiver");
+			break;
+		case 'l':
+			low_latency = 1;
+			break;
+		case 'g':
+			multicast_group = optarg;
+			break;
+		case 'i':
+			multicast_if = optarg;
+			break;
+		default:
+			argc = 0;
+		}
+	}
 
-	if (argc != 3) {
-		fprintf(stderr, "usage: %s UDP_port filename_to_write\n\n", argv[0]);
+	if (argc - optind != 2 || ack_every < 1 || ack_delay < 0 || deadline_us < 0
+			|| drop_percent < 0 || drop_percent > 100) {
+		fprintf(stderr, "usage: reliable_receiver [-ul] [-a segments] [-t usec] [-e ms] [-x pct] [-N cpus] [-D cpus] [-g group [-i address]] UDP_port filename_to_write\n"
+				"       filename_to_write '-' streams to stdout\n"
+				"       -u receives, writes and ACKs through io_uring when the kernel supports it\n"
+				"       -a -t ACK every that many segments or microseconds, %d and %d by default\n"
+				"       -e skips a missing segment after that many milliseconds\n"
+				"       -x drops that percentage of received datagrams to test loss\n"
+				"       -N -D pin network and disk threads to CPUs, as in 0-3,8 or node1\n"
+				"       -l busy polls the socket for latency critical flows\n"
+				"       -g joins a multicast group for a fan-out transfer, on the interface with address -i\n\n",
+				ACK_EVERY, ACK_DELAY);
 		exit(1);
 	}
+	argv += optind - 1;
 	udpPort = (unsigned short int) atoi(argv[1]);
 	sprintf(port, "%d", udpPort);
 	sprintf(send_port, "%d", udpPort + 5);
@@ -98,9 +284,26 @@ void initialize_window(){
         window[i].received = 0;   
         window[i].seq = 0;
         window[i].size = 0 ;
+        window[i].decoded = 0;
+        window[i].nak_time = 0;
+        window[i].missing_since = 0;
+        window[i].skipped = 0;
     }
     
     available_slots = WINDOW_SIZE;
+
+    // Delayed ACK deadlines are on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&window_cond, &attr);
+}
+
+/* Monotonic clock in microseconds */
+long long int now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long int) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 // get sockaddr, IPv4 or IPv6:
@@ -112,23 +315,102 @@ void *get_in_addr(struct sockaddr *sa) {
 }
 
 void reliablyReceive(unsigned short int myUDPport, char* destinationFile) {
-    file = fopen(destinationFile, "w");
+    struct stat st;
+
+    destination_name = destinationFile;
+
+    if (strcmp(destinationFile, STREAM_NAME) == 0)
+        file = stdout;
+    else if (stat(destinationFile, &st) == -1 || S_ISREG(st.st_mode)){
+        // Written next to the existing copy, which delta transfers use,
+        // and replaces it once complete. Opened by the first request.
+        basis = fopen(destinationFile, "r");
+        partial_name = malloc(strlen(destinationFile) + 6);
+        sprintf(partial_name, "%s.part", destinationFile);
+    }
+    else if (S_ISDIR(st.st_mode))
+        message_dir = destinationFile;
+    else
+        file = fopen(destinationFile, "w");
     
-    if (file == NULL){
-        printf("reliable_receiver: Unable to create the destination file\n");
+    if (file == NULL && partial_name == NULL && message_dir == NULL){
+        fprintf(stderr, "reliable_receiver: Unable to create the destination file\n");
         exit(1);
     }
     
+	// This thread receives, writing and inflating go to the disk threads
+	pin_current_thread(NET_THREADS);
+
 	int sockfd = establish_receive_connection();
+
+	// Room for a whole window, the default drops datagrams past a few segments
+	tune_socket_buffer(sockfd, SO_RCVBUF, WINDOW_BYTES, "reliable_receiver");
+	if (low_latency)
+		tune_busy_poll(sockfd, "reliable_receiver");
+
+	if (multicast_group){
+		// Receivers of a group share the port, the socket allows it already
+		struct ip_mreq mreq;
+		memset(&mreq, 0, sizeof mreq);
+		if (inet_pton(AF_INET, multicast_group, &mreq.imr_multiaddr) != 1
+				|| (multicast_if && inet_pton(AF_INET, multicast_if, &mreq.imr_interface) != 1)){
+			fprintf(stderr, "reliable_receiver: bad multicast address\n");
+			exit(1);
+		}
+		if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq) == -1){
+			perror("reliable_receiver: IP_ADD_MEMBERSHIP");
+			exit(1);
+		}
+	}
+
+	// Wake up regularly so a finished receiver can repeat a lost FIN_ACK
+	struct timeval linger;
+	linger.tv_sec = 0;
+	linger.tv_usec = FIN_LINGER;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &linger, sizeof linger) == -1){
+		perror("setsockopt");
+		exit(1);
+	}
 	
 	pthread_t thread;
-	pthread_create(&thread, NULL, (void*)write_handler,(void*)NULL);
+	create_thread(&thread, DISK_THREADS, write_handler, NULL);
 	
+	int i;
+	for (i = 0; i < DECOMPRESS_THREADS; i++) {
+		pthread_t decompress_thread;
+		create_thread(&decompress_thread, DISK_THREADS, decompress_segments, NULL);
+	}
+	
+	if (ring_enabled && (ring_init(&recv_ring, sockfd) == -1
+			|| ring_provide_buffers(&recv_ring, MAXBUFLEN) == -1)) {
+		fprintf(stderr, "reliable_receiver: io_uring unavailable, using recvfrom\n");
+		ring_enabled = 0;
+	}
+
 	int all_done = 0;
+
+	// The first datagram tells where the ACKs go
+	while (!all_done && sender_host_name == NULL)
+		all_done = receivePacket(sockfd);
+
+	if (ring_enabled)
+		all_done = all_done || receive_with_ring();
 	
 	while (!all_done) {
 		all_done = receivePacket(sockfd);
 	}
+
+	pthread_join(thread, NULL);
+
+	if (bytes_reused > 0)
+		fprintf(stderr, "reliable_receiver: reused %llu bytes of the existing file\n", bytes_reused);
+	if (messages_received > 0)
+		fprintf(stderr, "reliable_receiver: received %d messages\n", messages_received);
+	fprintf(stderr, "reliable_receiver: sent %d ACKs for %d segments, %d NAKs\n",
+			acks_sent, segments_written, naks_sent);
+	if (segments_skipped > 0)
+		fprintf(stderr, "reliable_receiver: skipped %d segments past the deadline\n",
+				segments_skipped);
 }
 
 void *write_handler(void *datapv){
@@ -136,21 +418,294 @@ void *write_handler(void *datapv){
     int stop = 0;
     
 	while(!stop){
-		pthread_mutex_lock(&window_lock);	
+		pthread_mutex_lock(&window_lock);
+		// Sleep until the next in-order segment shows up, a delayed ACK is
+		// due or a hole runs out of time
+		while (window[map_seq_to_window(window_start)].received == 0
+				|| window[map_seq_to_window(window_start)].decoded == 0){
+			long long int now = now_us();
+			long long int wakeup = 0;
+			if (deadline_us > 0 && skip_expired(now, &wakeup) > 0)
+				continue;
+			if (unacked > 0){
+				long long int due = unacked_since + ack_delay;
+				if (now >= due){
+					ack_written();
+					flush_batch();
+					continue;
+				}
+				if (wakeup == 0 || due < wakeup)
+					wakeup = due;
+			}
+			if (wakeup == 0){
+				pthread_cond_wait(&window_cond, &window_lock);
+				continue;
+			}
+			struct timespec deadline;
+			deadline.tv_sec = wakeup / 1000000;
+			deadline.tv_nsec = (wakeup % 1000000) * 1000;
+			pthread_cond_timedwait(&window_cond, &window_lock, &deadline);
+		}
 		stop = write_to_file();	
 		pthread_mutex_unlock(&window_lock);
+
+		if (resumable && time(NULL) - last_sync >= RESUME_SYNC_INTERVAL)
+			save_received_map();
+	}
+
+	// The file is in place before the sender hears that it's done
+	finish_destination();
+
+	pthread_mutex_lock(&window_lock);
+	transfer_complete = 1;
+	pthread_mutex_unlock(&window_lock);
+
+	sendAck(sender_host_name, -1, available_slots); //this is the fin_ack
+	return NULL;
+}
+
+/* Replaces the destination with the completed partial file */
+void finish_destination(){
+	if (partial_name == NULL){
+		if (file)
+			fflush(file);
+		return;
+	}
+
+	if (resumable){
+		fflush(file);
+		if (ftruncate(fileno(file), resume_size) == -1){
+			perror("reliable_receiver: ftruncate");
+			exit(1);
+		}
+		close(map_fd);
+		unlink(map_name);
+	}
+	fclose(file);
+	if (rename(partial_name, destination_name) == -1){
+		perror("reliable_receiver: rename");
+		exit(1);
 	}
 }
 
+/*
+*   Nothing was heard for FIN_LINGER. Once the transfer is complete the
+*   FIN_ACK may have been lost, so repeat it a few times before giving up.
+*/
+int fin_timeout(){
+	if (!transfer_complete)
+		return 0;
+	if (++fin_retries > FIN_RETRIES)
+		return 1;
+	sendAck(sender_host_name, -1, available_slots);
+	return 0;
+}
+
+/*
+*   Opens the partial file. A resumed transfer keeps what is already in it,
+*   returns 1 if there was something to keep.
+*/
+int open_partial(int resume){
+    int kept = 0;
+
+    if (resume)
+        file = fopen(partial_name, "r+");
+    if (file)
+        kept = 1;
+    else
+        file = fopen(partial_name, "w");
+
+    if (file == NULL){
+        fprintf(stderr, "reliable_receiver: Unable to create the destination file\n");
+        exit(1);
+    }
+    return kept;
+}
+
+/*
+*   Flushes the partial file to disk, then records which blocks it holds.
+*   The map never claims a block before its data is durable.
+*/
+void save_received_map(){
+    fflush(file);
+    fsync(fileno(file));
+
+    unsigned char header[32];
+    memcpy(header, RESUME_MAP_MAGIC, 8);
+    memcpy(header + 8, &resume_size, 8);
+    memcpy(header + 16, &resume_mtime, 8);
+    int block_size = PAYLOAD_SIZE;
+    memcpy(header + 24, &block_size, 4);
+    memcpy(header + 28, &map_blocks, 4);
+
+    if (pwrite(map_fd, header, sizeof header, 0) != sizeof header
+            || pwrite(map_fd, received_map, map_bytes, sizeof header) != map_bytes){
+        perror("reliable_receiver: map write");
+        exit(1);
+    }
+    fsync(map_fd);
+
+    last_sync = time(NULL);
+}
+
+/*
+*   Sets up a resumable transfer of a size byte file. Progress persisted by an
+*   earlier run is kept if it was for the same file and the data is still there.
+*/
+void start_resume(long long size, long long mtime){
+    resume_size = size;
+    resume_mtime = mtime;
+    map_blocks = (size + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE;
+    map_bytes = (map_blocks + 7) / 8;
+    received_map = calloc(map_bytes + 1, 1);
+
+    // Sent sequentially to stdout, nothing can be resumed
+    if (partial_name == NULL)
+        return;
+
+    int kept = open_partial(1);
+
+    map_name = malloc(strlen(partial_name) + 5);
+    sprintf(map_name, "%s.map", partial_name);
+    map_fd = open(map_name, O_RDWR | O_CREAT, 0644);
+    if (map_fd == -1){
+        perror("reliable_receiver: map open");
+        exit(1);
+    }
+
+    unsigned char header[32];
+    unsigned char expected[32];
+    memcpy(expected, RESUME_MAP_MAGIC, 8);
+    memcpy(expected + 8, &resume_size, 8);
+    memcpy(expected + 16, &resume_mtime, 8);
+    int block_size = PAYLOAD_SIZE;
+    memcpy(expected + 24, &block_size, 4);
+    memcpy(expected + 28, &map_blocks, 4);
+
+    if (kept && pread(map_fd, header, sizeof header, 0) == sizeof header
+            && memcmp(header, expected, sizeof header) == 0
+            && pread(map_fd, received_map, map_bytes, sizeof header) == map_bytes){
+        fprintf(stderr, "reliable_receiver: resuming the partial file\n");
+    }
+    else
+        memset(received_map, 0, map_bytes);
+
+    int i;
+    missing_blocks = malloc(sizeof(int) * (map_blocks + 1));
+    for (i = 0; i < map_blocks; i++){
+        if (!(received_map[i / 8] & (1 << (i % 8))))
+            missing_blocks[missing_count++] = i;
+    }
+
+    resumable = 1;
+    save_received_map();
+}
+
+/* Answers the opening exchange of a resumable transfer with a chunk of the block map */
+void send_ranges(int chunk, long long size, long long mtime){
+    // A restarted sender, our window is still partway into the old transfer
+    pthread_mutex_lock(&window_lock);
+    if (window_start > 0 || highest_seq >= 0){
+        int header[4] = { RANGES_MSG, chunk, -1, 0 };
+        int i;
+        for (i = 0; i < FIN_RETRIES; i++)
+            send_message(header, RANGES_HEADER_SIZE);
+        if (resumable)
+            save_received_map();
+        fprintf(stderr, "reliable_receiver: the sender restarted mid-transfer, run again to resume\n");
+        exit(1);
+    }
+    pthread_mutex_unlock(&window_lock);
+
+    if (received_map == NULL)
+        start_resume(size, mtime);
+
+    int first = chunk * RANGE_BYTES_PER_CHUNK;
+    int count = map_bytes - first;
+    if (count < 0)
+        count = 0;
+    if (count > RANGE_BYTES_PER_CHUNK)
+        count = RANGE_BYTES_PER_CHUNK;
+
+    unsigned char *msg = malloc(DATA_SIZE);
+    int header[4] = { RANGES_MSG, chunk, map_blocks, count };
+    memcpy(msg, header, RANGES_HEADER_SIZE);
+    memcpy(msg + RANGES_HEADER_SIZE, received_map + first, count);
+
+    send_message(msg, RANGES_HEADER_SIZE + count);
+    free(msg);
+}
+
+/* Writes a segment of a resumed transfer at the offset of its block */
+void write_block(int seq, unsigned char *data, int size){
+    // The empty end of stream segment comes after the missing blocks
+    if (seq >= missing_count)
+        return;
+
+    int block = missing_blocks[seq];
+    fseeko(file, (off_t) block * PAYLOAD_SIZE, SEEK_SET);
+    fwrite(data, 1, size, file);
+    received_map[block / 8] |= 1 << (block % 8);
+}
+
+/*
+*   Decompression worker. Inflates queued segments outside the window lock
+*   and swaps the result into their slot so the writer can pick them up.
+*/
+void *decompress_segments(void *data){
+    z_stream stream;
+    memset(&stream, 0, sizeof stream);
+    if (inflateInit(&stream) != Z_OK){
+        fprintf(stderr, "reliable_receiver: inflateInit failed\n");
+        exit(1);
+    }
+
+    while (1){
+        pthread_mutex_lock(&window_lock);
+        while (decode_count == 0)
+            pthread_cond_wait(&decode_cond, &window_lock);
+
+        int slot = map_seq_to_window(decode_queue[decode_head]);
+        decode_head = map_seq_to_window(decode_head + 1);
+        decode_count--;
+
+        unsigned char *input = window[slot].data;
+        int size = window[slot].size;
+        pthread_mutex_unlock(&window_lock);
+
+        unsigned char *output = malloc(PAYLOAD_SIZE);
+        inflateReset(&stream);
+        stream.next_in = input;
+        stream.avail_in = size;
+        stream.next_out = output;
+        stream.avail_out = PAYLOAD_SIZE;
+        if (inflate(&stream, Z_FINISH) != Z_STREAM_END){
+            fprintf(stderr, "reliable_receiver: corrupt compressed segment\n");
+            exit(1);
+        }
+        free(input);
+
+        pthread_mutex_lock(&window_lock);
+        window[slot].data = output;
+        window[slot].size = PAYLOAD_SIZE - stream.avail_out;
+        window[slot].decoded = 1;
+        pthread_cond_signal(&window_cond);
+        pthread_mutex_unlock(&window_lock);
+    }
+}
+
 int receivePacket(int sockfd) {
 	int numbytes;
 	unsigned char buf[MAXBUFLEN];
 	char s[INET6_ADDRSTRLEN];
 	socklen_t addr_len = sizeof their_addr;
-	int drop_packet = 0;
 
 	if ((numbytes = recvfrom(sockfd, buf, MAXBUFLEN - 1, 0,
 			(struct sockaddr *) &their_addr, &addr_len)) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return fin_timeout();
+		if (errno == EINTR)
+			return 0;
 		perror("recvfrom");
 		exit(1);
 	}
@@ -160,98 +715,510 @@ int receivePacket(int sockfd) {
 		get_in_addr((struct sockaddr *) &their_addr), s, sizeof s);
 		send_sock = establish_send_connection(sender_host_name);
 	}
-	
-	//adding drop packets behavior
-	if (drop_packet){
-	    //int random_number = rand() % range + min;
-	    int random_number = rand() % 5 + 1;
-	    
-	    if (random_number == 1){
-	        //printf("droping packet....\n");
-	        return 0;
-	    }
-	}
 
-	// 4 bytes is end of stream notification
-	if(strncmp(buf, "DONE_TRANSFER", 13) == 0) {
-	    char *token, *running;
-		running = strdup(buf);
-		char delimiters[] = "|";
-		
-		token = strsep (&running, delimiters);
-		token = strsep (&running, delimiters);
-		unsigned long long int last_value = atoll(token);
-		
-		//printf("received FIN, last seq is #%llu\n", last_value);
-		
-		if (last_seq == -1){
-		    last_seq = last_value;
+	return handle_packet(buf, numbytes);
+}
+
+/*
+*   io_uring receive loop, used once the sender's address is known. Each
+*   io_uring_enter reaps every datagram the multishot receive has queued.
+*   Returns 1 when the transfer is over, 0 if the kernel has no multishot
+*   receive after all.
+*/
+int receive_with_ring(){
+	struct RingCompletion completion;
+	int all_done = 0;
+
+	ring_recv_multishot(&recv_ring);
+	while (!all_done) {
+		if (ring_submit_and_wait(&recv_ring, 1, FIN_LINGER) == -1) {
+			if (errno == ETIME) {
+				all_done = fin_timeout();
+				continue;
+			}
+			perror("recvfrom");
+			exit(1);
 		}
-		else{
-		    if (window_start > 0){	        
-		        if (window_start > last_seq){
-		            //printf("reliable_receiver: sending FIN_ACK\n");
-		            sendAck(sender_host_name, -1, -1); //this is the fin_ack
-		        }
-		    }
+
+		while (!all_done && ring_next_completion(&recv_ring, &completion)) {
+			unsigned char *buf = ring_buffer(&recv_ring, &completion);
+			if (completion.res > 0 && buf) {
+				// Room for the terminator handle_packet() adds
+				int numbytes = completion.res < MAXBUFLEN ? completion.res : MAXBUFLEN - 1;
+				all_done = handle_packet(buf, numbytes);
+			} else if (completion.res == -EINVAL) {
+				fprintf(stderr, "reliable_receiver: no multishot receive, using recvfrom\n");
+				return 0;
+			} else if (completion.res < 0 && completion.res != -ENOBUFS) {
+				errno = -completion.res;
+				perror("recvfrom");
+				exit(1);
+			}
+			ring_recycle_buffer(&recv_ring, &completion);
+			// Out of buffers or otherwise stopped, start it again
+			if (ring_recv_stopped(&completion))
+				ring_recv_multishot(&recv_ring);
 		}
-	}else if (strncmp(buf, "CLOSE_TRANSFER", 14) == 0){
+	}
+	return 1;
+}
+
+/* Handles a datagram from the sender, returns 1 once the transfer is over */
+int handle_packet(unsigned char *buf, int numbytes) {
+	buf[numbytes] = 0;
+	
+	// Simulated loss, -x: drop that percentage of what arrives
+	if (drop_percent > 0 && rand() % 100 < drop_percent){
+	    return 0;
+	}
+
+	if (strncmp(buf, "CLOSE_TRANSFER", 14) == 0){
+        // Like an extra member of a group the sender wasn't told about: the
+        // writer still waits for segments that will never come
+        pthread_mutex_lock(&window_lock);
+        int complete = transfer_complete;
+        pthread_mutex_unlock(&window_lock);
+        if (!complete){
+            fprintf(stderr, "reliable_receiver: sender closed the transfer before it completed\n");
+            exit(1);
+        }
         return 1;
+	}else if (strncmp(buf, "RANGES_REQUEST", 14) == 0){
+		long long size;
+		long long mtime;
+		int chunk;
+		if (sscanf(buf, "RANGES_REQUEST|%lld|%lld|%d", &size, &mtime, &chunk) == 3)
+			send_ranges(chunk, size, mtime);
+	}else if (strncmp(buf, "SKIP_TO", 7) == 0){
+		// The sender gave up on what is still missing before that seq
+		char *token = strchr(buf, '|');
+		if (token){
+			int skip_to = atoi(token + 1);
+			int seq;
+			pthread_mutex_lock(&window_lock);
+			for (seq = window_start; seq < skip_to && seq < window_start + WINDOW_SIZE; seq++){
+				if (window[map_seq_to_window(seq)].received == 0)
+					skip_segment(seq);
+			}
+			send_skipped();
+			// Our ACK past them may have been lost, so send it again
+			sendAck(sender_host_name, window_start - 1, available_slots);
+			if (transfer_complete)
+				sendAck(sender_host_name, -1, available_slots);
+			// The sender's window is stuck on them, ACK past them right away
+			ack_now = 1;
+			pthread_cond_signal(&window_cond);
+			pthread_mutex_unlock(&window_lock);
+		}
+	}else if (strncmp(buf, "SIGNATURE_REQUEST", 17) == 0){
+		char *token = strchr(buf, '|');
+		if (token)
+			send_signatures(atoi(token + 1));
 	}
 	else {
 
 		int seq;
 		int size;
+		int flags;
 		memcpy(&seq, buf, sizeof(int));
 		memcpy(&size, buf + sizeof(int), sizeof(int));
-		unsigned char* payload = malloc(size);
-		memcpy(payload, buf + 2*sizeof(int), size);
+		memcpy(&flags, buf + 2*sizeof(int), sizeof(int));
 
-        if (last_seq > 0 && window_start > last_seq){
-            
-        }
-        
-		if (available_slots > 0){
-			if (seq > (window_start + WINDOW_SIZE)){
-				printf("Packet with seq #%d out of bound for window\n",seq);
-				return 0;
-			}
+		// Not one of our segments, don't read past the datagram
+		if (numbytes < (int) HEADER_SIZE || size < 0 || size > numbytes - (int) HEADER_SIZE)
+			return 0;
 
-			available_slots--;
-			//store packet in window
-			int slot = map_seq_to_window(seq);
-			if (window[slot].received == 1 && window[slot].written == 0){
-				//printf("reliable_receiver: Attempt to override packet not yet consumed\n");
-				return 0;
-			}
-			pthread_mutex_lock(&window_lock);
+		pthread_mutex_lock(&window_lock);
+
+		// Already written, our ACK got lost so send it again
+		if (seq < window_start){
+			sendAck(sender_host_name, window_start - 1, available_slots);
+			if (transfer_complete)
+				sendAck(sender_host_name, -1, available_slots);
+			pthread_mutex_unlock(&window_lock);
+			return 0;
+		}
 
-			window[slot].received = 1;
-			window[slot].written = 0;
-			window[slot].ack = 0;
-			window[slot].seq = seq;
-			window[slot].size = size;
-			window[slot].data = payload;
+		if (seq >= window_start + WINDOW_SIZE){
+			fprintf(stderr, "Packet with seq #%d out of bound for window\n",seq);
+			pthread_mutex_unlock(&window_lock);
+			return 0;
+		}
 
+		//store packet in window
+		int slot = map_seq_to_window(seq);
+		if (window[slot].received == 1){
+			//printf("reliable_receiver: Duplicate of a packet not yet consumed\n");
 			pthread_mutex_unlock(&window_lock);
+			return 0;
+		}
+
+		if (file == NULL && partial_name != NULL)
+			open_partial(0);
+
+		unsigned char* payload = malloc(size);
+		memcpy(payload, buf + HEADER_SIZE, size);
+
+		// The end of stream is signaled in-band by the sender
+		if (flags & FLAG_EOS){
+			last_seq = seq;
+		}
+
+		available_slots--;
+
+		window[slot].received = 1;
+		window[slot].written = 0;
+		window[slot].ack = 0;
+		window[slot].seq = seq;
+		window[slot].size = size;
+		window[slot].data = payload;
+		window[slot].decoded = !(flags & FLAG_COMPRESSED);
+		window[slot].flags = flags;
+
+		if (flags & FLAG_COMPRESSED){
+			decode_queue[map_seq_to_window(decode_head + decode_count)] = seq;
+			decode_count++;
+			pthread_cond_signal(&decode_cond);
+		}
+
+		if (seq > highest_seq)
+			highest_seq = seq;
+
+		// Past a hole: report what is missing right away so the sender can
+		// repair it, and ACK as soon as the hole is filled
+		if (seq != window_start && window[map_seq_to_window(window_start)].received == 0){
+			ack_now = 1;
+			send_nak();
 		}
+
+		pthread_cond_signal(&window_cond);
+		pthread_mutex_unlock(&window_lock);
 	}
 	
 	return 0;
 }
 
-void sendAck(char* hostName, int seq, int slots) {
-	unsigned char* ack = malloc(sizeof(int));
-	memcpy(ack, &seq, sizeof(int));
+void send_message(void *data, int size) {
 	int sentBytes;
 	if (client_info) {
-		if ((sentBytes = sendto(send_sock, ack, sizeof(int), 0,
+		if ((sentBytes = sendto(send_sock, data, size, 0,
 				client_info->ai_addr, client_info->ai_addrlen)) == -1) {
 			perror("packet send:");
 			exit(1);
 		}
 	}
 }
+
+void sendAck(char* hostName, int seq, int slots) {
+	send_message(&seq, sizeof(int));
+}
+
+/*
+*   Answers a signature request with one chunk of the block signatures of
+*   the existing file, computing them all on the first request.
+*/
+void send_signatures(int chunk){
+    if (basis_blocks < 0){
+        basis_blocks = 0;
+        if (basis){
+            struct stat st;
+            fstat(fileno(basis), &st);
+            basis_block_size = delta_block_size(st.st_size);
+            basis_blocks = compute_signatures(fileno(basis), st.st_size,
+                    basis_block_size, &signatures);
+        }
+    }
+
+    int first = chunk * SIGNATURES_PER_CHUNK;
+    int count = basis_blocks - first;
+    if (count < 0)
+        count = 0;
+    if (count > SIGNATURES_PER_CHUNK)
+        count = SIGNATURES_PER_CHUNK;
+
+    unsigned char *msg = malloc(DATA_SIZE);
+    int header[5] = { SIGNATURE_MSG, chunk, basis_blocks, basis_block_size, count };
+    memcpy(msg, header, SIGNATURE_HEADER_SIZE);
+
+    int i;
+    for (i = 0; i < count; i++){
+        unsigned char *entry = msg + SIGNATURE_HEADER_SIZE + i * SIGNATURE_ENTRY_SIZE;
+        memcpy(entry, &signatures[first + i].weak, sizeof(uint32_t));
+        memcpy(entry + sizeof(uint32_t), signatures[first + i].strong, STRONG_SIZE);
+    }
+
+    send_message(msg, SIGNATURE_HEADER_SIZE + count * SIGNATURE_ENTRY_SIZE);
+    free(msg);
+}
+
+/*
+*   Writes a run of blocks of the existing file the sender referenced
+*/
+void copy_basis_blocks(unsigned char *ref){
+    int block;
+    int count;
+    memcpy(&block, ref, sizeof(int));
+    memcpy(&count, ref + sizeof(int), sizeof(int));
+
+    if (block < 0 || count < 0 || block + count > basis_blocks){
+        fprintf(stderr, "reliable_receiver: reference to missing block #%d\n", block);
+        exit(1);
+    }
+
+    unsigned char *buffer = malloc(basis_block_size);
+    int i;
+    for (i = 0; i < count; i++){
+        off_t offset = (off_t) (block + i) * basis_block_size;
+        if (pread(fileno(basis), buffer, basis_block_size, offset) != basis_block_size){
+            perror("reliable_receiver: basis read");
+            exit(1);
+        }
+        fwrite(buffer, 1, basis_block_size, file);
+    }
+    free(buffer);
+
+    bytes_reused += (unsigned long long) count * basis_block_size;
+}
+/*
+*   Strips the name from the first segment of a session message. Into a
+*   directory the message is written as a file of that name, otherwise
+*   messages follow each other in the destination.
+*/
+void start_message(unsigned char **data, int *size){
+    int name_length;
+    char name[NAME_MAX + 1];
+
+    memcpy(&name_length, *data, INT_SIZE);
+    if (name_length < 0 || name_length > NAME_MAX || name_length > *size - (int) INT_SIZE){
+        fprintf(stderr, "reliable_receiver: malformed message name\n");
+        exit(1);
+    }
+    memcpy(name, *data + INT_SIZE, name_length);
+    name[name_length] = 0;
+    *data += INT_SIZE + name_length;
+    *size -= INT_SIZE + name_length;
+
+    if (message_dir == NULL)
+        return;
+
+    // Only a plain name is accepted, the sender can't write outside the directory
+    if (name_length == 0 || strchr(name, '/') || strcmp(name, ".") == 0
+            || strcmp(name, "..") == 0){
+        fprintf(stderr, "reliable_receiver: refusing message name '%s'\n", name);
+        exit(1);
+    }
+
+    char *path = malloc(strlen(message_dir) + name_length + 2);
+    sprintf(path, "%s/%s", message_dir, name);
+    if (file){
+        flush_batch();
+        fclose(file);
+    }
+    file = fopen(path, "w");
+    strcpy(message_name, name);
+    output_offset = 0;
+    if (file == NULL){
+        perror("reliable_receiver: fopen");
+        exit(1);
+    }
+    free(path);
+}
+
+/*
+*   Lists the holes below the highest segment received, each reported at most
+*   once per NAK_INTERVAL. Called with window_lock held.
+*/
+void send_nak(){
+    int nak[WINDOW_SIZE + 3];
+    int count = 0;
+    long long int now = now_us();
+    int seq;
+
+    for (seq = window_start; seq < highest_seq && seq < window_start + WINDOW_SIZE; seq++){
+        struct window_slot *slot = &window[map_seq_to_window(seq)];
+        if (slot->received)
+            continue;
+        if (slot->missing_since == 0)
+            slot->missing_since = now;
+        if (now - slot->nak_time < NAK_INTERVAL)
+            continue;
+        slot->nak_time = now;
+        nak[3 + count++] = seq;
+    }
+    if (count == 0)
+        return;
+
+    nak[0] = NAK_MSG;
+    nak[1] = window_start - 1;
+    nak[2] = count;
+    send_message(nak, (3 + count) * sizeof(int));
+    naks_sent++;
+}
+
+/*
+*   Skips the holes missing for longer than the deadline. Returns how many,
+*   and lowers next_expiry to when the next one runs out. Called with
+*   window_lock held.
+*/
+int skip_expired(long long int now, long long int *next_expiry){
+    int skipped = 0;
+    int seq;
+
+    for (seq = window_start; seq < highest_seq && seq < window_start + WINDOW_SIZE; seq++){
+        struct window_slot *slot = &window[map_seq_to_window(seq)];
+        if (slot->received || slot->missing_since == 0)
+            continue;
+        long long int expiry = slot->missing_since + deadline_us;
+        if (now >= expiry){
+            skip_segment(seq);
+            skipped++;
+        } else if (*next_expiry == 0 || expiry < *next_expiry){
+            *next_expiry = expiry;
+        }
+    }
+    send_skipped();
+    return skipped;
+}
+
+/* Stands in an empty segment for a missing one, called with window_lock held */
+void skip_segment(int seq){
+    struct window_slot *slot = &window[map_seq_to_window(seq)];
+
+    available_slots--;
+    slot->received = 1;
+    slot->written = 0;
+    slot->ack = 0;
+    slot->seq = seq;
+    slot->size = 0;
+    slot->data = NULL;
+    slot->decoded = 1;
+    slot->flags = 0;
+    slot->skipped = 1;
+    segments_skipped++;
+    skipped_seqs[skipped_pending++] = seq;
+}
+
+/*
+*   Tells the sender which segments were just skipped, ahead of the ACK
+*   that covers them. Called with window_lock held.
+*/
+void send_skipped(){
+    int report[WINDOW_SIZE + 2];
+
+    if (skipped_pending == 0)
+        return;
+    report[0] = SKIPPED_MSG;
+    report[1] = skipped_pending;
+    memcpy(report + 2, skipped_seqs, skipped_pending * sizeof(int));
+    send_message(report, (2 + skipped_pending) * sizeof(int));
+    skipped_pending = 0;
+}
+
+/* Cumulative ACK of everything written so far, called with window_lock held */
+void ack_written(){
+    ack_segment(window_start - 1);
+    segments_written += unacked;
+    acks_sent++;
+    unacked = 0;
+    ack_now = 0;
+}
+
+/* ACKs a written segment, queued with the batch when the writer has a ring */
+void ack_segment(int seq){
+    if (ring_enabled && write_ring_state == 0){
+        // Set up by the writer itself, the ring is only used from its thread
+        if (ring_init(&write_ring, send_sock) == 0)
+            write_ring_state = 1;
+        else {
+            fprintf(stderr, "reliable_receiver: io_uring unavailable for writes, using write\n");
+            write_ring_state = -1;
+        }
+    }
+
+    if (write_ring_state != 1){
+        sendAck(sender_host_name, seq, available_slots);
+        return;
+    }
+
+    int i = batch_ack_count++;
+    batch_acks[i] = seq;
+    batch_ack_iov[i].iov_base = &batch_acks[i];
+    batch_ack_iov[i].iov_len = sizeof(int);
+    memset(&batch_msgs[i], 0, sizeof batch_msgs[i]);
+    batch_msgs[i].msg_name = client_info->ai_addr;
+    batch_msgs[i].msg_namelen = client_info->ai_addrlen;
+    batch_msgs[i].msg_iov = &batch_ack_iov[i];
+    batch_msgs[i].msg_iovlen = 1;
+}
+
+/* Writes what a short batched write left out, starting done bytes in */
+void write_batch_rest(size_t done){
+    int i;
+    for (i = 0; i < batch_count; i++){
+        size_t length = batch_iov[i].iov_len;
+        if (done >= length){
+            done -= length;
+            continue;
+        }
+        if (fwrite((unsigned char *) batch_iov[i].iov_base + done, 1, length - done, file)
+                != length - done){
+            perror("reliable_receiver: write");
+            exit(1);
+        }
+        done = 0;
+    }
+}
+
+/*
+*   Submits the batched destination write and ACKs with one io_uring_enter
+*   and waits for them, the segment buffers are released once written.
+*/
+void flush_batch(){
+    if (batch_count == 0 && batch_ack_count == 0)
+        return;
+
+    int waiting = 0;
+    if (batch_count > 0){
+        // Anything still buffered by stdio goes first
+        fflush(file);
+        ring_writev(&write_ring, fileno(file), batch_iov, batch_count, RING_WRITE);
+        waiting++;
+    }
+    int i;
+    for (i = 0; i < batch_ack_count; i++){
+        ring_sendmsg(&write_ring, &batch_msgs[i], 0);
+        waiting++;
+    }
+
+    if (ring_submit_and_wait(&write_ring, waiting, -1) == -1){
+        perror("reliable_receiver: io_uring_enter");
+        exit(1);
+    }
+
+    struct RingCompletion completion;
+    while (waiting > 0){
+        if (!ring_next_completion(&write_ring, &completion)){
+            ring_submit_and_wait(&write_ring, 1, -1);
+            continue;
+        }
+        waiting--;
+
+        if (completion.res < 0){
+            errno = -completion.res;
+            perror(completion.user_data == RING_WRITE ? "reliable_receiver: write" : "packet send:");
+            exit(1);
+        }
+        if (completion.user_data == RING_WRITE && completion.res < batch_bytes)
+            write_batch_rest(completion.res);
+    }
+
+    for (i = 0; i < batch_count; i++)
+        free(batch_data[i]);
+    batch_count = 0;
+    batch_bytes = 0;
+    batch_ack_count = 0;
+}
+
 /*
 *Writes the provided data to the destination file
 */
@@ -267,18 +1234,84 @@ int write_to_file(){
 			window_start++;
 		}
 		
-		if (window[idx].received == 0)
+		if (window[idx].received == 0 || window[idx].decoded == 0)
 			break;
 
-		fwrite(window[idx].data, 1, window[idx].size , file);
+		unsigned char *data = window[idx].data;
+		int size = window[idx].size;
+		int flags = window[idx].flags;
+		if (window[idx].flags & FLAG_MSG_START){
+			start_message(&data, &size);
+			message_lost = 0;
+		}
+
+		// A skipped segment may have held the end of one message and the
+		// start of the next, so in a directory the open message ends there
+		// and nothing is written until another one starts
+		if (window[idx].skipped){
+			if (message_dir && file)
+				fprintf(stderr, "reliable_receiver: skipped segment #%d, '%s' cut short at byte %lld\n",
+						window[idx].seq, message_name, output_offset);
+			else if (message_dir)
+				fprintf(stderr, "reliable_receiver: skipped segment #%d\n", window[idx].seq);
+			else
+				fprintf(stderr, "reliable_receiver: skipped segment #%d at byte %lld\n",
+						window[idx].seq, output_offset);
+		}
+		if (window[idx].skipped && message_dir && !message_lost){
+			if (file){
+				// The batch still holds the end of that message
+				flush_batch();
+				fclose(file);
+				file = NULL;
+			}
+			message_lost = 1;
+		}
+
+		// Only plain appends are batched, anything else keeps its place after them
+		int batched = write_ring_state == 1 && file && !resumable && !window[idx].skipped
+				&& !(window[idx].flags & (FLAG_BLOCK_REF | FLAG_MSG_START | FLAG_MSG_END));
+		if (!batched)
+			flush_batch();
+
+		if (window[idx].skipped || message_lost)
+			;
+		else if (window[idx].flags & FLAG_BLOCK_REF)
+			copy_basis_blocks(data);
+		else if (resumable)
+			write_block(window[idx].seq, data, size);
+		else if (batched){
+			batch_iov[batch_count].iov_base = data;
+			batch_iov[batch_count].iov_len = size;
+			batch_data[batch_count++] = window[idx].data;
+			batch_bytes += size;
+			output_offset += size;
+		}
+		else if (file){
+			fwrite(data, 1, size, file);
+			output_offset += size;
+		}
+		else if (size > 0){
+			fprintf(stderr, "reliable_receiver: a directory only receives sessions (-m)\n");
+			exit(1);
+		}
+
+		if ((window[idx].flags & FLAG_MSG_END) && !message_lost){
+			messages_received++;
+			if (message_dir && file){
+				fclose(file);
+				file = NULL;
+			}
+		}
 		
 		available_slots++;
 		
-		//send the ack
-		sendAck(sender_host_name, window[idx].seq, available_slots);
-		
 		window[idx].received = 0;
-		free(window[idx].data);
+		window[idx].nak_time = 0;
+		window[idx].missing_since = 0;
+		window[idx].skipped = 0;
+		if (!batched)
+			free(window[idx].data);
 		window[idx].data = NULL;
 		window[idx].seq = 0;
 		window[idx].ack = 0;
@@ -286,15 +1319,31 @@ int write_to_file(){
 		written_count++;
 		//move the window
 		window_start++;
+
+		// ACK the sender's last segment before a stall right away, the others
+		// a few at a time
+		if (unacked++ == 0)
+			unacked_since = now_us();
+		if ((flags & (FLAG_ACK_NOW | FLAG_EOS)) || unacked >= ack_every)
+			ack_written();
     }
+
+    if (ack_now && unacked > 0)
+        ack_written();
 	
+    flush_batch();
+
+    // Hand the data over right away, a consumer on a pipe is waiting for it
+    if (written_count > 0 && file)
+        fflush(file);
+
     //mark the index in the sliding window of what we need to write next
     next_non_written += written_count;
     
     //wrap it around
     next_non_written = map_seq_to_window(next_non_written);
 
-    if (last_seq > 0 && window_start > last_seq)
+    if (last_seq >= 0 && window_start > last_seq)
         return 1;
  
     return 0;
@@ -377,12 +1426,17 @@ int establish_send_connection(char* hostname) {
 		return 2;
 	}
 	
-	freeaddrinfo(servinfo);
-	
 	client_info = malloc(sizeof *p);
 	
 	*client_info = *p;
 	
+	// Keep our own copy of the address, servinfo owns the original
+	client_info->ai_addr = malloc(p->ai_addrlen);
+	memcpy(client_info->ai_addr, p->ai_addr, p->ai_addrlen);
+	client_info->ai_next = NULL;
+
+	freeaddrinfo(servinfo);
+	
 	return sockfd;
 }
 
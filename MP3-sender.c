@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,25 +13,63 @@
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
+#include <poll.h>
+#include <limits.h>
+#include <zlib.h>
 
 #include "helper.h"
+#include "delta.h"
+#include "ring.h"
+#include "tune.h"
 
 #define SIG SIGUSR1
-#define INT_SIZE sizeof(int)
-#define HEADER_SIZE 2*INT_SIZE
-#define TIMEOUT 1
-#define PAYLOAD_SIZE (DATA_SIZE - HEADER_SIZE)
+/* Retransmission timeout in microseconds, estimated as in RFC 6298 */
+#define INITIAL_RTO 1000000
+#define MIN_RTO 10000
+#define MAX_RTO 2000000
+/* Floor of the tail loss probe timeout, in microseconds */
+#define MIN_PTO 2000
+/* Probes sent at the tail before leaving it to the retransmission timer */
+#define MAX_TAIL_PROBES 2
+/* Congestion window in segments when the transfer starts */
+#define INITIAL_CWND 4
+/* Receivers of a fan-out transfer */
+#define MAX_RECEIVERS 64
+
+/* Threads compressing segments ahead of the sliding window */
+#define COMPRESS_THREADS 2
+/* A segment must shrink by at least 1/8 to be sent compressed */
+#define MIN_COMPRESS_GAIN 8
+/* Most segments skipped after an incompressible one before sampling again */
+#define MAX_COMPRESS_BACKOFF 64
+
+/* Scan buffer of the delta encoder: a full literal segment plus lookahead */
+#define DELTA_BUF_SIZE (PAYLOAD_SIZE + 2 * DELTA_MAX_BLOCK)
+/* Microseconds to wait for a chunk of a receiver reply before asking again */
+#define CHUNK_RETRY 200000
 
 void reliablyTransfer(char* hostname, unsigned short int hostUDPport,
 		char* filename, unsigned long long int bytesToTransfer);
 void sendPacket(unsigned char* packet);
 int establish_send_connection(char* host);
 int establish_receive_connection();
-int is_window_entry_timedout(int index);
+int is_window_entry_timedout(int index, long long int now);
 void *listen_for_ack(void* data);
 int window_has_room();
-void send_eof_notification();
 void *resend_timed_out_packets(void *pdata);
+void send_data(void *data, int size);
+void resend_entry(int index, long long int now);
+void probe_entry(int index, long long int now);
+void ack_packet(int seq, struct sockaddr* from, socklen_t from_len);
+void retransmission_timeout(long long int now);
+long long int abandon_expired(long long int now);
+void send_skip(long long int now);
+size_t read_segment(unsigned char* buffer, size_t max_size);
+unsigned char* next_segment(size_t* size, int* flags);
+size_t delta_next_segment(unsigned char* out, int* flags);
+size_t resume_next_segment(unsigned char* buffer);
+size_t message_next_segment(unsigned char* buffer, int* flags);
+void *compress_segments(void *data);
 
 //struct addrinfo hints, *servinfo, *p;
 struct addrinfo *sender_info, *receiver_info;
@@ -43,11 +82,156 @@ volatile unsigned long long int num_bytes_sent = 0;
 int last_seq_ack = 0;
 int last_seq = 0;
 int fin_ack_received = 0;
+int eos_sent = 0;
 timer_t window_slot_timer;
 pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t window_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t resend_cond;
+
+/* Round trip estimate and timers, in microseconds, guarded by lock */
+int rtt_samples = 0;
+long long int srtt = 0;
+long long int rttvar = 0;
+long long int rto = INITIAL_RTO;
+long long int last_progress = 0;
+int tail_probes = 0;
+
+/* Reno congestion control, the window never grows past WINDOW_SIZE */
+double cwnd = INITIAL_CWND;
+double ssthresh = WINDOW_SIZE;
+int recovery_seq = 0;
+int recovery_resent = -1;
+
+/* ACK traffic, the receiver coalesces cumulative ACKs and reports holes */
+int acks_received = 0;
+int segments_acked = 0;
+int naks_received = 0;
+int repairs_sent = 0;
+
+/*
+*   Partial reliability, -e: a segment not acknowledged this many
+*   microseconds after it first went out is no longer repaired, and the
+*   receivers are told to skip whatever they still miss before skip_to.
+*/
+long long int deadline_us = 0;
+int skip_to = 0;
+long long int skip_sent = 0;
+
+/*
+*   What the receivers actually skipped, as they report it. A message with
+*   a skipped segment was never delivered in full and has no latency.
+*/
+int segments_skipped = 0;
+int messages_skipped = 0;
+int message_incomplete = 0;
+
+/*
+*   Where segments go: the receiver, each host of a fan-out list, or a
+*   multicast group. Every segment is read once and sent to all of them.
+*/
+struct sockaddr_storage destinations[MAX_RECEIVERS];
+socklen_t destination_lengths[MAX_RECEIVERS];
+int destination_count = 0;
+char* multicast_if = NULL;
+
+/*
+*   Receivers are told apart by the address their feedback comes from. The
+*   window slides at the slowest one, the transfer ends once all are done.
+*/
+struct Receiver {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int acked;
+	int done;
+};
+struct Receiver receivers[MAX_RECEIVERS];
+int receiver_count = 0;
+int expected_receivers = 1;
+int receivers_done = 0;
 
 /* Pointer to the file to be sent */
 FILE* fp;
+int source_eof = 0;
+unsigned long long int bytes_to_read;
+unsigned long long int read_bytes = 0;
+
+/* Segments read and compressed ahead of the window, in source order */
+struct Segment {
+	unsigned char* packet;
+	size_t size;
+	int flags;
+	int ready;
+};
+struct Segment pipeline[WINDOW_SIZE];
+int compress_enabled = 0;
+int pipeline_read = 0;
+int pipeline_next = 0;
+int pipeline_eos = 0;
+pthread_mutex_t source_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pipeline_cond = PTHREAD_COND_INITIALIZER;
+
+/* Adaptive compression state, guarded by pipeline_lock */
+int compress_skip = 0;
+int compress_backoff = 1;
+int segments_compressed = 0;
+unsigned long long int raw_bytes_compressed = 0;
+unsigned long long int wire_bytes_compressed = 0;
+
+/* Block signatures of the receiver's copy, guarded by lock while fetched */
+int delta_enabled = 0;
+int delta_block = 0;
+int delta_num_blocks = -1;
+int signature_chunks = 0;
+struct BlockSignature* signatures = NULL;
+int* signature_head;
+int* signature_next;
+uint32_t signature_mask;
+pthread_cond_t chunk_cond = PTHREAD_COND_INITIALIZER;
+
+/* Delta encoder scan state, literal data is delta_buf[literal_start, delta_pos) */
+unsigned char* delta_buf;
+size_t delta_len = 0;
+size_t delta_pos = 0;
+size_t literal_start = 0;
+int delta_rolling = 0;
+uint32_t delta_weak;
+int delta_match = -1;
+int blocks_matched = 0;
+unsigned long long int literal_bytes = 0;
+
+/* Resumable transfers, segment seq i carries block missing_blocks[i] */
+int resume_enabled = 0;
+long long int resume_size;
+long long int resume_mtime;
+int resume_blocks = -1;
+int range_chunks = 0;
+unsigned char* received_map = NULL;
+int* missing_blocks;
+int missing_count = 0;
+int resume_next = 0;
+
+/* Sessions send each file as a message over the same flow */
+int session_enabled = 0;
+char** message_files;
+int message_file_count = 0;
+long long int message_count = 0;
+long long int message_next = 0;
+long long int message_start = 0;
+long long int messages_acked = 0;
+
+/* Per message latency, first segment sent to last segment acknowledged */
+long long int* message_latency = NULL;
+long long int latency_count = 0;
+long long int latency_capacity = 0;
+long long int session_start = 0;
+
+/* Busy polls the ACK socket, -l */
+int low_latency = 0;
+
+/* io_uring for the ACK listener, -u */
+int ring_enabled = 0;
+struct Ring ack_ring;
 
 /* Port number for sending and receiving */
 char port[6];
@@ -57,7 +241,12 @@ char host[256];
 /* Sliding Window data structure*/
 struct SlidingWindow {
 	int seq;
-	time_t time_sent;
+	long long int time_sent;
+	long long int first_sent;
+	int retransmitted;
+	int abandoned;
+	int skipped;
+	long long int message_start;	/* last segment of a message: when it started */
 	int ack;
 	unsigned char* data;
 	size_t size;
@@ -100,6 +289,32 @@ void setup_timer(){
 }
 
 
+/* Monotonic clock in microseconds */
+long long int now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long int) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Folds a round trip sample into SRTT/RTTVAR and derives the RTO */
+void update_rtt(long long int sample) {
+	if (rtt_samples == 0) {
+		srtt = sample;
+		rttvar = sample / 2;
+	} else {
+		long long int error = sample > srtt ? sample - srtt : srtt - sample;
+		rttvar = (3 * rttvar + error) / 4;
+		srtt = (7 * srtt + sample) / 8;
+	}
+	rtt_samples++;
+
+	rto = srtt + 4 * rttvar;
+	if (rto < MIN_RTO)
+		rto = MIN_RTO;
+	if (rto > MAX_RTO)
+		rto = MAX_RTO;
+}
+
 /* Maps the actual sequence number to a index in sliding window */
 int map_seq_to_window(int seq) {
 	int index = seq % WINDOW_SIZE;
@@ -112,33 +327,738 @@ void init(char* filename, int udpPort) {
 		window[i].ack = 0;
 		window[i].seq = 0;
 		window[i].time_sent = 0;
+		window[i].first_sent = 0;
+		window[i].retransmitted = 0;
+		window[i].abandoned = 0;
+		window[i].skipped = 0;
+		window[i].message_start = 0;
 		window[i].data = NULL;
 		window[i].size = 0;
 	}
-	// Open file and keep the handle
-	fp = fopen(filename, "r");
+	// The resend thread sleeps until the next deadline on the monotonic clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&resend_cond, &attr);
+
+	// Open file and keep the handle, "-" streams from stdin.
+	// Sessions open each message file as they get to it.
+	if (filename == NULL)
+		fp = NULL;
+	else if (strcmp(filename, STREAM_NAME) == 0)
+		fp = stdin;
+	else
+		fp = fopen(filename, "r");
+
+	if (fp == NULL && filename != NULL) {
+		perror("reliable_sender: fopen");
+		exit(1);
+	}
 
 	// Convert port to string
 	sprintf(port, "%d", udpPort);
 	sprintf(ack_port, "%d", udpPort + 5);
 }
 
+/* Returns 1 if the source can be read without blocking */
+int source_has_data() {
+	struct pollfd pfd;
+	pfd.fd = fileno(fp);
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+*   Reads up to max_size bytes of the source. Blocks only until some data is
+*   available, so a slow producer on a pipe doesn't hold back what it already
+*   wrote. Returns 0 once the source is exhausted.
+*/
+size_t read_segment(unsigned char* buffer, size_t max_size) {
+	size_t filled = 0;
+	while (filled < max_size) {
+		if (filled > 0 && !source_has_data())
+			break;
+
+		ssize_t count = read(fileno(fp), buffer + filled, max_size - filled);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("reliable_sender: read");
+			exit(1);
+		}
+		if (count == 0) {
+			source_eof = 1;
+			break;
+		}
+		filled += count;
+	}
+	return filled;
+}
+
+/* Reads up to max_size bytes of the transfer, 0 once it is fully read */
+size_t read_source(unsigned char* buffer, size_t max_size) {
+	size_t actual_data_size = max_size;
+	if (bytes_to_read - read_bytes < max_size) {
+		actual_data_size = bytes_to_read - read_bytes;
+	}
+
+	size_t content_size = 0;
+	if (!source_eof && actual_data_size > 0) {
+		content_size = read_segment(buffer, actual_data_size);
+	}
+	if (content_size == 0) {
+		source_eof = 1;
+	}
+
+	read_bytes += content_size;
+	return content_size;
+}
+
+/* Reads the payload of the next segment and sets its flags */
+size_t read_next_segment(unsigned char* buffer, int* flags) {
+	size_t content_size;
+	*flags = 0;
+
+	if (session_enabled) {
+		content_size = message_next_segment(buffer, flags);
+	} else if (delta_enabled) {
+		content_size = delta_next_segment(buffer, flags);
+	} else if (resume_enabled) {
+		content_size = resume_next_segment(buffer);
+	} else {
+		content_size = read_source(buffer, PAYLOAD_SIZE);
+	}
+
+	// A message that shrank while being read still ends with an empty segment
+	if (content_size == 0 && !(*flags & FLAG_MSG_END)) {
+		*flags |= FLAG_EOS;
+	}
+	return content_size;
+}
+
+/*
+*   Reads the next segment of a session, one message per file. The first
+*   segment of a message starts with the file name, the last one is flagged
+*   so the receiver knows where it ends. Returns 0 after the last message.
+*/
+size_t message_next_segment(unsigned char* buffer, int* flags) {
+	size_t header = 0;
+
+	if (fp == NULL) {
+		if (message_next == message_count)
+			return 0;
+
+		char* path = message_files[message_next % message_file_count];
+		message_next++;
+
+		struct stat st;
+		fp = fopen(path, "r");
+		if (fp == NULL || fstat(fileno(fp), &st) == -1) {
+			perror("reliable_sender: fopen");
+			exit(1);
+		}
+		if (!S_ISREG(st.st_mode)) {
+			fprintf(stderr, "reliable_sender: %s: sessions only send regular files\n", path);
+			exit(1);
+		}
+		source_eof = 0;
+		read_bytes = 0;
+		bytes_to_read = st.st_size;
+
+		char* name = strrchr(path, '/');
+		name = name ? name + 1 : path;
+		int name_length = strlen(name);
+		memcpy(buffer, &name_length, INT_SIZE);
+		memcpy(buffer + INT_SIZE, name, name_length);
+		header = INT_SIZE + name_length;
+		*flags |= FLAG_MSG_START;
+	}
+
+	size_t content_size = read_source(buffer + header, PAYLOAD_SIZE - header);
+	if (read_bytes == bytes_to_read || source_eof) {
+		*flags |= FLAG_MSG_END;
+		fclose(fp);
+		fp = NULL;
+	}
+	return header + content_size;
+}
+
+/* Records how long a message took to be acknowledged, called with lock held */
+void record_latency(long long int latency) {
+	if (latency_count == latency_capacity) {
+		latency_capacity = latency_capacity ? 2 * latency_capacity : 1024;
+		message_latency = realloc(message_latency, latency_capacity * sizeof(long long int));
+	}
+	message_latency[latency_count++] = latency;
+}
+
+int compare_latency(const void* a, const void* b) {
+	long long int x = *(const long long int*) a;
+	long long int y = *(const long long int*) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Prints the message rate and latency percentiles of a session */
+void print_session_stats() {
+	if (latency_count == 0)
+		return;
+
+	qsort(message_latency, latency_count, sizeof(long long int), compare_latency);
+	long long int elapsed = now_us() - session_start;
+	printf("reliable_sender: %lld messages in %lld us, %.0f messages/s\n",
+			latency_count, elapsed, latency_count * 1000000.0 / (elapsed ? elapsed : 1));
+	printf("reliable_sender: latency p50 %lld us, p99 %lld us, max %lld us\n",
+			message_latency[(latency_count - 1) * 50 / 100],
+			message_latency[(latency_count - 1) * 99 / 100],
+			message_latency[latency_count - 1]);
+	if (messages_skipped > 0)
+		printf("reliable_sender: %d messages lost segments past the deadline, not counted above\n",
+				messages_skipped);
+}
+
+/*
+*   Asks for the next chunk of a reply the receiver splits over several
+*   datagrams and waits a little for it to be stored. Called with lock held,
+*   the caller asks again until it has every chunk.
+*/
+void request_chunk(char* request, int* chunks) {
+	char buffer[256];
+	int nchars = sprintf(buffer, "%s|%d", request, *chunks);
+	send_data(buffer, nchars + 1);
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += CHUNK_RETRY * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	int chunk = *chunks;
+	while (chunk == *chunks
+			&& pthread_cond_timedwait(&chunk_cond, &lock, &deadline) == 0)
+		;
+}
+
+/* Copies a chunk of the receiver's block map, if it is the next one */
+void store_ranges(unsigned char* buf, int size) {
+	int header[4];
+	memcpy(header, buf, RANGES_HEADER_SIZE);
+	int chunk = header[1];
+	int count = header[3];
+
+	pthread_mutex_lock(&lock);
+	// The receiver was still on an earlier run of this transfer
+	if (received_map == NULL && header[2] < 0) {
+		fprintf(stderr, "reliable_sender: the receiver was mid-transfer, restart it to resume\n");
+		exit(1);
+	}
+	if (chunk == range_chunks && count >= 0 && count <= RANGE_BYTES_PER_CHUNK
+			&& size >= RANGES_HEADER_SIZE + count
+			&& (received_map != NULL || header[2] >= 0)) {
+		if (received_map == NULL) {
+			resume_blocks = header[2];
+			received_map = calloc(resume_blocks / 8 + 1, 1);
+		}
+
+		// Only as many bytes as the map the first chunk announced
+		if ((long long) chunk * RANGE_BYTES_PER_CHUNK + count > resume_blocks / 8 + 1) {
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		memcpy(received_map + chunk * RANGE_BYTES_PER_CHUNK,
+				buf + RANGES_HEADER_SIZE, count);
+
+		range_chunks++;
+		pthread_cond_broadcast(&chunk_cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+*   Opening exchange of a resumable transfer. The receiver answers with the
+*   map of blocks it already has on disk, and only the others get sent.
+*/
+void fetch_ranges() {
+	char request[128];
+	sprintf(request, "RANGES_REQUEST|%lld|%lld", resume_size, resume_mtime);
+
+	pthread_mutex_lock(&lock);
+	while (resume_blocks < 0
+			|| range_chunks * RANGE_BYTES_PER_CHUNK * 8 < resume_blocks) {
+		request_chunk(request, &range_chunks);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (resume_blocks != (resume_size + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE) {
+		fprintf(stderr, "reliable_sender: receiver expects %d blocks\n", resume_blocks);
+		exit(1);
+	}
+
+	int i;
+	missing_blocks = malloc(sizeof(int) * (resume_blocks + 1));
+	for (i = 0; i < resume_blocks; i++) {
+		if (!(received_map[i / 8] & (1 << (i % 8))))
+			missing_blocks[missing_count++] = i;
+	}
+}
+
+/* Reads the next block the receiver is missing */
+size_t resume_next_segment(unsigned char* buffer) {
+	if (resume_next == missing_count)
+		return 0;
+
+	off_t offset = (off_t) missing_blocks[resume_next++] * PAYLOAD_SIZE;
+	size_t size = PAYLOAD_SIZE;
+	if (resume_size - offset < PAYLOAD_SIZE)
+		size = resume_size - offset;
+
+	size_t filled = 0;
+	while (filled < size) {
+		ssize_t count = pread(fileno(fp), buffer + filled, size - filled, offset + filled);
+		if (count <= 0) {
+			perror("reliable_sender: pread");
+			exit(1);
+		}
+		filled += count;
+	}
+
+	read_bytes += size;
+	return size;
+}
+
+/* Asks the receiver for its block signatures, one chunk at a time */
+void fetch_signatures() {
+	pthread_mutex_lock(&lock);
+	while (delta_num_blocks < 0
+			|| signature_chunks * SIGNATURES_PER_CHUNK < delta_num_blocks) {
+		request_chunk("SIGNATURE_REQUEST", &signature_chunks);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* Copies a signature chunk sent by the receiver, if it is the next one */
+void store_signatures(unsigned char* buf, int size) {
+	int header[5];
+	memcpy(header, buf, SIGNATURE_HEADER_SIZE);
+	int chunk = header[1];
+	int count = header[4];
+
+	pthread_mutex_lock(&lock);
+	if (chunk == signature_chunks && count >= 0 && count <= SIGNATURES_PER_CHUNK
+			&& size >= SIGNATURE_HEADER_SIZE + count * SIGNATURE_ENTRY_SIZE
+			&& (signatures != NULL || (header[2] >= 0
+				&& header[3] >= DELTA_MIN_BLOCK && header[3] <= DELTA_MAX_BLOCK))) {
+		if (signatures == NULL) {
+			delta_num_blocks = header[2];
+			delta_block = header[3];
+			signatures = malloc(sizeof(struct BlockSignature) * (delta_num_blocks + 1));
+		}
+
+		// Only as many entries as the first chunk announced
+		if ((long long) chunk * SIGNATURES_PER_CHUNK + count > delta_num_blocks) {
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+
+		int i;
+		for (i = 0; i < count; i++) {
+			unsigned char* entry = buf + SIGNATURE_HEADER_SIZE + i * SIGNATURE_ENTRY_SIZE;
+			struct BlockSignature* signature = &signatures[chunk * SIGNATURES_PER_CHUNK + i];
+			memcpy(&signature->weak, entry, sizeof(uint32_t));
+			memcpy(signature->strong, entry + sizeof(uint32_t), STRONG_SIZE);
+		}
+
+		signature_chunks++;
+		pthread_cond_broadcast(&chunk_cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+uint32_t signature_bucket(uint32_t weak) {
+	uint32_t hash = weak * 2654435761u;
+	return (hash ^ (hash >> 16)) & signature_mask;
+}
+
+/* Chains the signatures by weak checksum, lowest block first */
+void index_signatures() {
+	uint32_t buckets = 16;
+	while (buckets < 2 * (uint32_t) delta_num_blocks)
+		buckets *= 2;
+	signature_mask = buckets - 1;
+
+	signature_head = malloc(sizeof(int) * buckets);
+	signature_next = malloc(sizeof(int) * delta_num_blocks);
+	memset(signature_head, -1, sizeof(int) * buckets);
+
+	int i;
+	for (i = delta_num_blocks - 1; i >= 0; i--) {
+		uint32_t bucket = signature_bucket(signatures[i].weak);
+		signature_next[i] = signature_head[bucket];
+		signature_head[bucket] = i;
+	}
+}
+
+/* Returns the receiver block holding the data, -1 if there is none */
+int find_block(uint32_t weak, unsigned char* data) {
+	unsigned char strong[STRONG_SIZE];
+	int hashed = 0;
+	int i;
+
+	for (i = signature_head[signature_bucket(weak)]; i >= 0; i = signature_next[i]) {
+		if (signatures[i].weak != weak)
+			continue;
+		// Only pay for the strong hash once the weak one matched
+		if (!hashed) {
+			strong_hash(data, delta_block, strong);
+			hashed = 1;
+		}
+		if (memcmp(strong, signatures[i].strong, STRONG_SIZE) == 0)
+			return i;
+	}
+	return -1;
+}
+
+int block_matches(int block, unsigned char* data) {
+	unsigned char strong[STRONG_SIZE];
+	if (block >= delta_num_blocks
+			|| weak_checksum(data, delta_block) != signatures[block].weak)
+		return 0;
+	strong_hash(data, delta_block, strong);
+	return memcmp(strong, signatures[block].strong, STRONG_SIZE) == 0;
+}
+
+/* Tops up the scan buffer so a whole block follows delta_pos, if the source has it */
+void delta_fill() {
+	if (delta_len - delta_pos >= delta_block || source_eof)
+		return;
+
+	// Sent data is dropped from the front of the buffer
+	if (literal_start > 0) {
+		memmove(delta_buf, delta_buf + literal_start, delta_len - literal_start);
+		delta_len -= literal_start;
+		delta_pos -= literal_start;
+		literal_start = 0;
+	}
+
+	while (delta_len - delta_pos < delta_block && !source_eof) {
+		delta_len += read_source(delta_buf + delta_len, DELTA_BUF_SIZE - delta_len);
+	}
+}
+
+size_t delta_literal(unsigned char* out, size_t size) {
+	memcpy(out, delta_buf + literal_start, size);
+	literal_start += size;
+	literal_bytes += size;
+	return size;
+}
+
+/* Encodes a run of consecutive receiver blocks starting at block */
+size_t delta_reference(unsigned char* out, int block, int* flags) {
+	int count = 1;
+	delta_pos += delta_block;
+	literal_start = delta_pos;
+
+	while (count < DELTA_MAX_RUN) {
+		delta_fill();
+		if (delta_len - delta_pos < delta_block
+				|| !block_matches(block + count, delta_buf + delta_pos))
+			break;
+		count++;
+		delta_pos += delta_block;
+		literal_start = delta_pos;
+	}
+
+	delta_rolling = 0;
+	blocks_matched += count;
+
+	memcpy(out, &block, INT_SIZE);
+	memcpy(out + INT_SIZE, &count, INT_SIZE);
+	*flags |= FLAG_BLOCK_REF;
+	return 2 * INT_SIZE;
+}
+
+/*
+*   Produces the next delta segment: either literal source data, or a
+*   reference to blocks the receiver already has. The weak checksum rolls
+*   one byte at a time until a block of the receiver matches.
+*/
+size_t delta_next_segment(unsigned char* out, int* flags) {
+	while (1) {
+		delta_fill();
+
+		// Less than a block left, the rest of the source goes as literal data
+		if (delta_len - delta_pos < delta_block) {
+			size_t size = delta_len - literal_start;
+			if (size > PAYLOAD_SIZE)
+				size = PAYLOAD_SIZE;
+			delta_literal(out, size);
+			if (delta_pos < literal_start)
+				delta_pos = literal_start;
+			delta_rolling = 0;
+			return size;
+		}
+
+		if (delta_pos - literal_start == PAYLOAD_SIZE) {
+			return delta_literal(out, PAYLOAD_SIZE);
+		}
+
+		if (!delta_rolling) {
+			delta_weak = weak_checksum(delta_buf + delta_pos, delta_block);
+			delta_rolling = 1;
+		}
+
+		// A match found behind pending literal data is kept for the next call
+		int block = delta_match >= 0 ? delta_match
+				: find_block(delta_weak, delta_buf + delta_pos);
+		if (block >= 0) {
+			if (delta_pos > literal_start) {
+				delta_match = block;
+				return delta_literal(out, delta_pos - literal_start);
+			}
+			delta_match = -1;
+			return delta_reference(out, block, flags);
+		}
+
+		if (delta_pos + delta_block < delta_len) {
+			delta_weak = roll_checksum(delta_weak, delta_buf[delta_pos],
+					delta_buf[delta_pos + delta_block], delta_block);
+		} else {
+			delta_rolling = 0;
+		}
+		delta_pos++;
+	}
+}
+
+/*
+*   Deflates raw into out unless recent segments turned out incompressible.
+*   After a segment that doesn't shrink enough the next ones are sent raw,
+*   doubling the number skipped until a sampled segment compresses again.
+*   Returns the payload size and sets FLAG_COMPRESSED when out is deflated.
+*/
+size_t compress_segment(z_stream* stream, unsigned char* raw, size_t size,
+		unsigned char* out, int* flags) {
+	int sample = 0;
+	pthread_mutex_lock(&pipeline_lock);
+	if (compress_skip > 0) {
+		compress_skip--;
+	} else {
+		sample = 1;
+	}
+	pthread_mutex_unlock(&pipeline_lock);
+
+	if (sample && size > 0 && !(*flags & FLAG_BLOCK_REF)) {
+		deflateReset(stream);
+		stream->next_in = raw;
+		stream->avail_in = size;
+		stream->next_out = out;
+		stream->avail_out = PAYLOAD_SIZE;
+
+		int ret = deflate(stream, Z_FINISH);
+		size_t compressed_size = PAYLOAD_SIZE - stream->avail_out;
+		int worth_it = ret == Z_STREAM_END
+				&& compressed_size < size - size / MIN_COMPRESS_GAIN;
+
+		pthread_mutex_lock(&pipeline_lock);
+		if (worth_it) {
+			compress_backoff = 1;
+			segments_compressed++;
+			raw_bytes_compressed += size;
+			wire_bytes_compressed += compressed_size;
+		} else {
+			compress_skip = compress_backoff;
+			if (compress_backoff < MAX_COMPRESS_BACKOFF)
+				compress_backoff *= 2;
+		}
+		pthread_mutex_unlock(&pipeline_lock);
+
+		if (worth_it) {
+			*flags |= FLAG_COMPRESSED;
+			return compressed_size;
+		}
+	}
+
+	memcpy(out, raw, size);
+	return size;
+}
+
+/*
+*   Compression worker. Segments are read one at a time under source_lock so
+*   they keep the source order, then compressed in parallel with the other
+*   workers into their pipeline slot.
+*/
+void *compress_segments(void *data) {
+	z_stream stream;
+	memset(&stream, 0, sizeof stream);
+	if (deflateInit(&stream, Z_BEST_SPEED) != Z_OK) {
+		fprintf(stderr, "reliable_sender: deflateInit failed\n");
+		exit(1);
+	}
+
+	unsigned char* raw = malloc(PAYLOAD_SIZE);
+	while (1) {
+		pthread_mutex_lock(&source_lock);
+		if (pipeline_eos) {
+			pthread_mutex_unlock(&source_lock);
+			break;
+		}
+
+		// Never run more than a window ahead of the sender
+		pthread_mutex_lock(&pipeline_lock);
+		while (pipeline_read >= pipeline_next + WINDOW_SIZE) {
+			pthread_cond_wait(&pipeline_cond, &pipeline_lock);
+		}
+		int index = map_seq_to_window(pipeline_read++);
+		pthread_mutex_unlock(&pipeline_lock);
+
+		int flags;
+		size_t raw_size = read_next_segment(raw, &flags);
+		if (flags & FLAG_EOS) {
+			pipeline_eos = 1;
+		}
+		pthread_mutex_unlock(&source_lock);
+
+		struct Segment* segment = &pipeline[index];
+		segment->packet = malloc(DATA_SIZE);
+		segment->flags = flags;
+		segment->size = compress_segment(&stream, raw, raw_size,
+				segment->packet + HEADER_SIZE, &segment->flags);
+
+		pthread_mutex_lock(&pipeline_lock);
+		segment->ready = 1;
+		pthread_cond_broadcast(&pipeline_cond);
+		pthread_mutex_unlock(&pipeline_lock);
+	}
+
+	free(raw);
+	deflateEnd(&stream);
+	return NULL;
+}
+
+/*
+*   Returns a packet holding the payload of the next segment, either read
+*   straight from the source or taken in order from the compression workers.
+*/
+unsigned char* next_segment(size_t* size, int* flags) {
+	if (!compress_enabled) {
+		unsigned char* packet = malloc(DATA_SIZE);
+		*size = read_next_segment(packet + HEADER_SIZE, flags);
+		return packet;
+	}
+
+	pthread_mutex_lock(&pipeline_lock);
+	struct Segment* segment = &pipeline[map_seq_to_window(pipeline_next)];
+	while (!segment->ready) {
+		pthread_cond_wait(&pipeline_cond, &pipeline_lock);
+	}
+	unsigned char* packet = segment->packet;
+	*size = segment->size;
+	*flags = segment->flags;
+	segment->packet = NULL;
+	segment->ready = 0;
+	pipeline_next++;
+	pthread_cond_broadcast(&pipeline_cond);
+	pthread_mutex_unlock(&pipeline_lock);
+
+	return packet;
+}
+
 int main(int argc, char** argv) {
 	unsigned short int udpPort;
 	unsigned long long int numBytes;
-	if (argc != 5) {
+	long long int repeat = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "zdrmn:uN:D:lF:i:e:")) != -1) {
+		switch (opt) {
+		case 'z':
+			compress_enabled = 1;
+			break;
+		case 'd':
+			delta_enabled = 1;
+			break;
+		case 'r':
+			resume_enabled = 1;
+			break;
+		case 'm':
+			session_enabled = 1;
+			break;
+		case 'n':
+			repeat = atoll(optarg);
+			break;
+		case 'u':
+			ring_enabled = 1;
+			break;
+		case 'N':
+			set_thread_cpus(NET_THREADS, optarg, "reliable_sender");
+			break;
+		case 'D':
+			set_thread_cpus(DISK_THREADS, optarg, "reliable_sender");
+			break;
+		case 'l':
+			low_latency = 1;
+			break;
+		case 'F':
+			expected_receivers = atoi(optarg);
+			break;
+		case 'i':
+			multicast_if = optarg;
+			break;
+		case 'e':
+			deadline_us = atoll(optarg) * 1000;
+			break;
+		default:
+			argc = 0;
+		}
+	}
+	argv += optind;
+	argc -= optind;
+
+	int usage_error = (argc != 3 && argc != 4) || (delta_enabled && resume_enabled);
+	if (session_enabled)
+		usage_error = argc < 3 || delta_enabled || resume_enabled || repeat < 1;
+	// Deltas and resumes are negotiated with one receiver
+	int fan_out = expected_receivers != 1 || (argc > 0 && strchr(argv[0], ',') != NULL);
+	if (expected_receivers < 1 || expected_receivers > MAX_RECEIVERS
+			|| (fan_out && (delta_enabled || resume_enabled)))
+		usage_error = 1;
+	// A delta or resumed file is only correct if every block arrives
+	if (deadline_us < 0 || (deadline_us > 0 && (delta_enabled || resume_enabled)))
+		usage_error = 1;
+
+	if (usage_error) {
 		fprintf(stderr,
-				"usage: %s receiver_hostname receiver_port filename_to_xfer bytes_to_xfer\n\n",
-				argv[0]);
+				"usage: reliable_sender [-zul] [-N cpus] [-D cpus] [-d | -r | -e ms] receiver_hostname receiver_port filename_to_xfer [bytes_to_xfer]\n"
+				"       reliable_sender [-zul] [-N cpus] [-D cpus] [-e ms] -m [-n repeat] receiver_hostname receiver_port file...\n"
+				"       reliable_sender [-zul] [-N cpus] [-D cpus] [-e ms] [-F receivers] [-i address] host,host...|group receiver_port ...\n"
+				"       filename_to_xfer '-' streams stdin until end of input\n"
+				"       -z compresses segments that benefit from it\n"
+				"       -d only sends what differs from the receiver's existing file\n"
+				"       -r resumes where a previous -r transfer of the file stopped\n"
+				"       -m sends each file as a message over one session, -n times over\n"
+				"       -u receives ACKs through io_uring when the kernel supports it\n"
+				"       -N -D pin network and disk threads to CPUs, as in 0-3,8 or node1\n"
+				"       -l busy polls the ACK socket for latency critical flows\n"
+				"       -F waits for that many receivers of a multicast group, sent from -i\n"
+				"       -e stops repairing a segment that many milliseconds after it was sent\n\n");
 		exit(1);
 	}
 
-	udpPort = (unsigned short int) atoi(argv[2]);
-	numBytes = strtoull(argv[4], NULL, 10);
-	
-	memcpy(host,argv[1], strlen(argv[1]));
+	udpPort = (unsigned short int) atoi(argv[1]);
+	snprintf(host, sizeof host, "%s", argv[0]);
 
-	reliablyTransfer(argv[1], udpPort, argv[3], numBytes);
+	if (session_enabled) {
+		message_files = argv + 2;
+		message_file_count = argc - 2;
+		message_count = repeat * message_file_count;
+		reliablyTransfer(argv[0], udpPort, NULL, ULLONG_MAX);
+		return 0;
+	}
+
+	// Without a byte count the whole input is sent, whatever its length
+	numBytes = argc == 4 ? strtoull(argv[3], NULL, 10) : ULLONG_MAX;
+
+	reliablyTransfer(argv[0], udpPort, argv[2], numBytes);
 	return 0;
 }
 
@@ -147,84 +1067,182 @@ void reliablyTransfer(char* hostName, unsigned short int udpPort,
 
 	init(fileName, udpPort);
 
+	// This thread sends, the source reads of -z go to the disk threads
+	pin_current_thread(NET_THREADS);
+
 	/* Opens the connection for sending packets */
 	send_socket = establish_send_connection(hostName);
+	int i;
+	for (i = 0; i < MAX_RECEIVERS; i++)
+		receivers[i].acked = -1;
+	// Slow start and timeouts can put a whole window out at once
+	tune_socket_buffer(send_socket, SO_SNDBUF, WINDOW_BYTES, "reliable_sender");
 
-	/* Start listening for ack */
+	/* Start listening for ack, bound before anything is sent so no ACK is missed */
+	receive_socket = establish_receive_connection();
+	// Receivers are told apart by source address, which the multishot receive drops
+	if (ring_enabled && expected_receivers > 1) {
+		fprintf(stderr, "reliable_sender: io_uring can't tell receivers apart, using recvfrom\n");
+		ring_enabled = 0;
+	}
+	if (ring_enabled && (ring_init(&ack_ring, receive_socket) == -1
+			|| ring_provide_buffers(&ack_ring, MAXBUFLEN) == -1)) {
+		fprintf(stderr, "reliable_sender: io_uring unavailable, using recvfrom\n");
+		ring_enabled = 0;
+	}
+	if (low_latency)
+		tune_busy_poll(receive_socket, "reliable_sender");
 	pthread_t thread;
-	pthread_create(&thread, NULL, (void*) listen_for_ack, NULL);
+	create_thread(&thread, NET_THREADS, listen_for_ack, NULL);
 
 	int expected_ack = 0;
-	unsigned long long int read_bytes = 0;
 	int total_ack_bytes = 0;
+	bytes_to_read = numBytes;
 
-	printf("Max number of bytes to send: %llu\n", numBytes);
+	if (session_enabled)
+		printf("Sending %lld messages\n", message_count);
+	else
+		printf("Max number of bytes to send: %llu\n", numBytes);
 	
 	pthread_t thread2;
-	pthread_create(&thread2, NULL, (void*) resend_timed_out_packets, NULL);
+	create_thread(&thread2, NET_THREADS, resend_timed_out_packets, NULL);
+
+	if (resume_enabled) {
+		struct stat st;
+		if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode)) {
+			fprintf(stderr, "reliable_sender: only regular files can be resumed\n");
+			exit(1);
+		}
+		resume_size = st.st_size < numBytes ? st.st_size : numBytes;
+		resume_mtime = st.st_mtime;
+
+		fetch_ranges();
+		printf("reliable_sender: receiver is missing %d of %d blocks\n",
+				missing_count, resume_blocks);
+	}
+
+	if (delta_enabled) {
+		fetch_signatures();
+		printf("reliable_sender: receiver has %d blocks of %d bytes\n",
+				delta_num_blocks, delta_block);
+		// Nothing to match against, send the file as is
+		if (delta_num_blocks == 0) {
+			delta_enabled = 0;
+		} else {
+			index_signatures();
+			delta_buf = malloc(DELTA_BUF_SIZE);
+		}
+	}
+
+	if (compress_enabled) {
+		int i;
+		for (i = 0; i < COMPRESS_THREADS; i++) {
+			pthread_t compress_thread;
+			create_thread(&compress_thread, DISK_THREADS, compress_segments, NULL);
+		}
+	}
+
 
+	session_start = now_us();
 
 	/* Loop through the file content and send packets to fill a window */
 	while (1) {
-		// Check if file is all read or enough bytes are sent
-		if (feof(fp) || read_bytes >= numBytes) {
-			//printf("reliable_sender: All file blocks were fully added to the window.\n");
-			send_eof_notification();
-			usleep(100000);
-			//break;
+		// Check if the end of stream segment went out
+		if (eos_sent) {
+			// The receiver's FIN_ACK ends the transfer once everything is written
+			pthread_mutex_lock(&lock);
+			while (!fin_ack_received) {
+				pthread_cond_wait(&window_cond, &lock);
+			}
+			pthread_mutex_unlock(&lock);
 		} else if (window_has_room()) { // Sending next packet if there is room in sliding window
+			// Read outside the lock, a pipe blocks until the producer writes.
+			// An empty segment tells the receiver the stream is over.
+			size_t content_size;
+			int flags;
+			unsigned char* packet = next_segment(&content_size, &flags);
+
 			pthread_mutex_lock(&lock);
-			// Calculating how many bytes to pack into the packet
-			int actual_data_size = 0;
-			if (numBytes - read_bytes < PAYLOAD_SIZE) {
-				actual_data_size = numBytes - read_bytes;
+
+			if (flags & FLAG_EOS) {
 				last_seq = current_seq;
-			} else {
-				actual_data_size = PAYLOAD_SIZE;
+				eos_sent = 1;
 			}
 
-			unsigned char* packet = malloc(DATA_SIZE);
-			unsigned char* data_block = malloc(actual_data_size);
-			size_t content_size = fread(data_block, 1, actual_data_size, fp);
-
-			read_bytes += content_size;
+			// Nothing more can go out until this one is ACKed, ask for it now
+			int allowed = cwnd < WINDOW_SIZE ? (int) cwnd : WINDOW_SIZE;
+			if ((flags & FLAG_EOS) || window_start + allowed <= current_seq + 1) {
+				flags |= FLAG_ACK_NOW;
+			}
 
 			/* Copy sequence number  to packet */
 			memcpy(packet, &current_seq, INT_SIZE);
 
 			/* Copy payload size to packet */
-			memcpy(packet + INT_SIZE, &content_size, INT_SIZE);
+			int payload_size = content_size;
+			memcpy(packet + INT_SIZE, &payload_size, INT_SIZE);
 
-			/* Copy payload to packet */
-			memcpy(packet + HEADER_SIZE, data_block, content_size);
+			/* Copy flags to packet */
+			memcpy(packet + 2 * INT_SIZE, &flags, INT_SIZE);
 
 			/* Create a window entry */
 			int index = map_seq_to_window(current_seq);
-			struct SlidingWindow entry = window[index];
 			window[index].seq = current_seq;
 			window[index].data = packet;
-			//window[index].data= malloc(sizeof(unsigned char) * content_size);
-			memcpy(window[index].data, packet, content_size);
 			
 			window[index].ack = 0;
-			window[index].time_sent = (int) time(NULL);
+			window[index].time_sent = now_us();
+			window[index].first_sent = window[index].time_sent;
+			window[index].retransmitted = 0;
+			window[index].abandoned = 0;
+			window[index].skipped = 0;
 			window[index].size = content_size;
+
+			if (flags & FLAG_MSG_START)
+				message_start = window[index].time_sent;
+			window[index].message_start = flags & FLAG_MSG_END ? message_start : 0;
 			
 			//printf("reliable_sender: sending seq #%d - payload %d bytes| %d/%d bytes\n", current_seq, strlen(data_block), read_bytes, numBytes);
 
 			sendPacket(packet);
+			last_progress = window[index].time_sent;
+
+			// The resend thread only needs a nudge to arm a timer it wasn't running
+			if (window_start + 1 == current_seq || eos_sent) {
+				pthread_cond_signal(&resend_cond);
+			}
 			current_seq++;
 
 			pthread_mutex_unlock(&lock);
 		} else {
-			//printf("Window is full\n");
-			//sleep(2);
-			//usleep(100000);
+			// Window is full, wait for ack_packet() to slide it
+			pthread_mutex_lock(&lock);
+			while (!window_has_room() && !fin_ack_received) {
+				pthread_cond_wait(&window_cond, &lock);
+			}
+			pthread_mutex_unlock(&lock);
 		}
 		// check sent packets and re-send timed out ones
 
         if (fin_ack_received == 1) {
 			printf("File successfully transferred!\n");
+			if (delta_enabled) {
+				printf("reliable_sender: reused %d blocks, %llu literal bytes\n",
+						blocks_matched, literal_bytes);
+			}
+			if (compress_enabled) {
+				printf("reliable_sender: compressed %d segments, %llu bytes sent as %llu\n",
+						segments_compressed, raw_bytes_compressed, wire_bytes_compressed);
+			}
+			if (session_enabled) {
+				print_session_stats();
+			}
+			printf("reliable_sender: %d ACKs for %d segments, %d NAKs, %d repairs\n",
+					acks_received, segments_acked, naks_received, repairs_sent);
+			if (segments_skipped > 0) {
+				printf("reliable_sender: receivers skipped %d segments past the deadline\n",
+						segments_skipped);
+			}
 			break;
 		}
 		else{
@@ -251,48 +1269,270 @@ void reliablyTransfer(char* hostName, unsigned short int udpPort,
 	}
 }
 
+void resend_entry(int index, long long int now) {
+	// Past its deadline, the receivers skip it instead
+	if (window[index].abandoned)
+		return;
+
+	probe_entry(index, now);
+}
+
+/* Sends a segment again asking for an immediate ACK, even one past its deadline */
+void probe_entry(int index, long long int now) {
+	window[index].time_sent = now;
+	// Karn: the ACK of a retransmitted segment gives no round trip sample
+	window[index].retransmitted = 1;
+
+	// A repair fills a hole, the receiver shouldn't sit on its ACK
+	int flags;
+	memcpy(&flags, window[index].data + 2 * INT_SIZE, INT_SIZE);
+	flags |= FLAG_ACK_NOW;
+	memcpy(window[index].data + 2 * INT_SIZE, &flags, INT_SIZE);
+
+	sendPacket(window[index].data);
+}
+
+/*
+*   A receiver reported holes. Each is repaired once for everyone: a NAK for
+*   a segment resent less than a round trip ago is covered by that repair.
+*   The first loss sent after the last cut halves the window, as in Reno.
+*/
+void nak_packet(unsigned char* buf, int numbytes, struct sockaddr* from, socklen_t from_len) {
+	int cumulative;
+	int count;
+	memcpy(&cumulative, buf + INT_SIZE, INT_SIZE);
+	memcpy(&count, buf + 2 * INT_SIZE, INT_SIZE);
+	if (count < 0 || NAK_HEADER_SIZE + count * INT_SIZE > numbytes)
+		return;
+
+	if (cumulative >= 0)
+		ack_packet(cumulative, from, from_len);
+
+	pthread_mutex_lock(&lock);
+	naks_received++;
+	long long int now = now_us();
+	long long int repair_gap = rtt_samples > 0 ? srtt : MIN_PTO;
+
+	int i;
+	for (i = 0; i < count; i++) {
+		int seq;
+		memcpy(&seq, buf + NAK_HEADER_SIZE + i * INT_SIZE, INT_SIZE);
+		if (seq <= window_start || seq >= current_seq)
+			continue;
+
+		int index = map_seq_to_window(seq);
+		if (window[index].abandoned)
+			continue;
+		if (window[index].retransmitted && now - window[index].time_sent < repair_gap)
+			continue;
+
+		if (seq >= recovery_seq) {
+			int flight = current_seq - window_start - 1;
+			ssthresh = flight / 2 > 2 ? flight / 2 : 2;
+			cwnd = ssthresh;
+			recovery_seq = current_seq;
+			recovery_resent = seq;
+		}
+		resend_entry(index, now);
+		repairs_sent++;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/* Oldest unacked segment not past its deadline, called with lock held */
+int oldest_repairable() {
+	int seq = window_start + 1;
+	while (seq < current_seq - 1 && window[map_seq_to_window(seq)].abandoned)
+		seq++;
+	return seq;
+}
+
+/*
+*   Reno timeout: collapse the window to one segment and resend only the
+*   oldest one still worth repairing. Bursting the whole window again would
+*   only overflow the receiver the same way. The other timers restart, the holes behind get
+*   resent one round trip apart as partial ACKs come back.
+*/
+void retransmission_timeout(long long int now) {
+	int flight = current_seq - window_start - 1;
+	ssthresh = flight / 2 > 2 ? flight / 2 : 2;
+	cwnd = 1;
+	recovery_seq = current_seq;
+
+	int oldest = oldest_repairable();
+	recovery_resent = oldest;
+
+	int seq;
+	for (seq = window_start + 1; seq < current_seq; seq++) {
+		if (seq != oldest)
+			window[map_seq_to_window(seq)].time_sent = now;
+	}
+	resend_entry(map_seq_to_window(oldest), now);
+
+	// Back off until an ACK brings a fresh sample
+	rto = rto * 2 > MAX_RTO ? MAX_RTO : rto * 2;
+}
+
+/*
+*   A receiver skipped these segments, sent ahead of the ACK covering them.
+*   Each is counted once, however many receivers skipped it.
+*/
+void skipped_packet(unsigned char* buf, int numbytes) {
+	int count;
+	memcpy(&count, buf + INT_SIZE, INT_SIZE);
+	if (count < 0 || SKIPPED_HEADER_SIZE + count * INT_SIZE > numbytes)
+		return;
+
+	pthread_mutex_lock(&lock);
+	int i;
+	for (i = 0; i < count; i++) {
+		int seq;
+		memcpy(&seq, buf + SKIPPED_HEADER_SIZE + i * INT_SIZE, INT_SIZE);
+		if (seq <= window_start || seq >= current_seq)
+			continue;
+
+		int index = map_seq_to_window(seq);
+		if (!window[index].skipped) {
+			fprintf(stderr, "reliable_sender: receivers skipped segment #%d\n", seq);
+			window[index].skipped = 1;
+			segments_skipped++;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+*   Gives up on the segments whose deadline passed, all but the end of
+*   stream, and tells the receivers to skip them. Returns when the next one
+*   expires, 0 if none will. Called with lock held.
+*/
+long long int abandon_expired(long long int now) {
+	long long int next_expiry = 0;
+	int abandoned = 0;
+	int seq;
+
+	for (seq = window_start + 1; seq < current_seq; seq++) {
+		int i = map_seq_to_window(seq);
+		if (window[i].abandoned || (eos_sent && seq == last_seq))
+			continue;
+
+		long long int expiry = window[i].first_sent + deadline_us;
+		if (now >= expiry) {
+			// Its ACK comes after the skip, no round trip sample in it
+			window[i].abandoned = 1;
+			window[i].retransmitted = 1;
+			abandoned = 1;
+			if (seq + 1 > skip_to)
+				skip_to = seq + 1;
+		} else if (next_expiry == 0 || expiry < next_expiry) {
+			next_expiry = expiry;
+		}
+	}
+
+	if (abandoned)
+		send_skip(now);
+	return next_expiry;
+}
+
+/* Tells the receivers what is no longer repaired, resent until they ACK past it */
+void send_skip(long long int now) {
+	char request[32];
+	sprintf(request, "SKIP_TO|%d", skip_to);
+	send_data(request, strlen(request));
+	skip_sent = now;
+}
+
+/*
+*   Retransmission timers. Sleeps until the earliest deadline of the window
+*   rather than polling. Once the end of stream is out, a tail loss probe
+*   resends the oldest unacked segment when no ACK came back for two round
+*   trips, so a lost last segment doesn't cost a whole RTO.
+*/
 void *resend_timed_out_packets(void *data){
 
+    pthread_mutex_lock(&lock);
     while(!fin_ack_received){
-        int i = 0;
-	    pthread_mutex_lock(&lock);
-	    for (i = 0; i < WINDOW_SIZE; i++) {
-		    struct SlidingWindow entry = window[i];
-		    if (window[i].data  && is_window_entry_timedout(i)) {
+        int seq = 0;
+        int timed_out = 0;
+        long long int now = now_us();
+        long long int next_wakeup = now + MAX_RTO;
+
+	    if (deadline_us > 0) {
+		    long long int expiry = abandon_expired(now);
+		    if (expiry > 0 && expiry < next_wakeup)
+			    next_wakeup = expiry;
+
+		    // The skip got lost or the receiver is still waiting on a repair
+		    if (skip_to > window_start + 1) {
+			    if (now >= skip_sent + rto) {
+				    send_skip(now);
+
+				    // Nothing left to time out, so probe with the head of the
+				    // window: an ACK comes back even if the skips keep getting lost
+				    int head = map_seq_to_window(window_start + 1);
+				    if (window[map_seq_to_window(oldest_repairable())].abandoned
+						    && window[head].data != NULL) {
+					    probe_entry(head, now);
+					    rto = rto * 2 > MAX_RTO ? MAX_RTO : rto * 2;
+				    }
+			    }
+			    if (skip_sent + rto < next_wakeup)
+				    next_wakeup = skip_sent + rto;
+		    }
+	    }
+
+	    // Oldest first, the receiver can't deliver anything until it gets it
+	    for (seq = window_start + 1; seq < current_seq; seq++) {
+		    int i = map_seq_to_window(seq);
+		    if (window[i].data == NULL || window[i].abandoned)
+			    continue;
 
-			    printf("packet %d is timed out.\n", entry.seq);
-			    window[i].time_sent = (int) time(NULL);
+		    if (is_window_entry_timedout(i, now)) {
+			    printf("packet %d is timed out.\n", window[i].seq);
+			    timed_out = 1;
+			    break;
+		    }
+		    if (window[i].time_sent + rto < next_wakeup)
+			    next_wakeup = window[i].time_sent + rto;
+	    }
 
-			    //printf("reliable_sender: Re-sending seq #%d\n", entry.seq);
+	    if (timed_out) {
+		    retransmission_timeout(now);
+		    next_wakeup = now + rto;
+	    }
 
-			    sendPacket(entry.data);
-			    
-			    //usleep(1000000);
+	    if (eos_sent && rtt_samples > 0 && window_start + 1 < current_seq
+			    && tail_probes < MAX_TAIL_PROBES) {
+		    long long int pto = 2 * srtt > MIN_PTO ? 2 * srtt : MIN_PTO;
+		    long long int probe_at = last_progress + pto;
+		    if (now >= probe_at) {
+			    int i = map_seq_to_window(oldest_repairable());
+			    printf("reliable_sender: tail loss probe for seq #%d\n", window[i].seq);
+			    resend_entry(i, now);
+			    tail_probes++;
+			    last_progress = now;
+			    probe_at = now + pto;
 		    }
+		    if (probe_at < next_wakeup)
+			    next_wakeup = probe_at;
 	    }
-	    pthread_mutex_unlock(&lock);
+
+	    struct timespec deadline;
+	    deadline.tv_sec = next_wakeup / 1000000;
+	    deadline.tv_nsec = (next_wakeup % 1000000) * 1000;
+	    pthread_cond_timedwait(&resend_cond, &lock, &deadline);
     }
+    pthread_mutex_unlock(&lock);
+    return NULL;
 }
 
-int is_window_entry_timedout(int index) {
-	struct SlidingWindow entry = window[index];
-	int now = (int) time(NULL);
-	if (now - entry.time_sent >= TIMEOUT) {
+int is_window_entry_timedout(int index, long long int now) {
+	if (now - window[index].time_sent >= rto) {
 		return 1;
 	}
 	return 0;
 }
 
-/* Send a notification of 4 bytes to receiver notifying it that transfer is over */
-void send_eof_notification() {
-	char buffer[256];
-	bzero(buffer, 256);
-	int nchars = sprintf(buffer, "DONE_TRANSFER|%d", last_seq);
-	buffer[nchars] = 0;
-	
-	send_data(buffer, strlen(buffer));
-}
-
 /* Send a cose notification */
 void send_close_notification() {
 	char buffer[] = "CLOSE_TRANSFER";
@@ -301,48 +1541,160 @@ void send_close_notification() {
 }
 
 int window_has_room() {
-	if (window_start + WINDOW_SIZE > current_seq)
+	int allowed = cwnd < WINDOW_SIZE ? (int) cwnd : WINDOW_SIZE;
+	if (window_start + allowed > current_seq)
 		return 1;
 	return 0;
 }
 
-void ack_packet(int seq) {
+/*
+*   The receiver some feedback came from. A single receiver is whoever
+*   answers, the receivers of a fan-out are registered as they first report.
+*   Called with lock held, returns NULL for one too many.
+*/
+struct Receiver* find_receiver(struct sockaddr* from, socklen_t from_len) {
+	if (expected_receivers == 1)
+		return &receivers[0];
+
+	int i;
+	for (i = 0; i < receiver_count; i++) {
+		if (receivers[i].addr_len == from_len
+				&& memcmp(&receivers[i].addr, from, from_len) == 0)
+			return &receivers[i];
+	}
+	if (receiver_count == expected_receivers)
+		return NULL;
+
+	struct Receiver* receiver = &receivers[receiver_count++];
+	memcpy(&receiver->addr, from, from_len);
+	receiver->addr_len = from_len;
+	printf("reliable_sender: receiver %d of %d joined\n", receiver_count, expected_receivers);
+	return receiver;
+}
+
+/* Highest seq every receiver has written, -1 until they all reported */
+int slowest_ack() {
+	if (expected_receivers == 1)
+		return receivers[0].acked;
+	if (receiver_count < expected_receivers)
+		return -1;
+
+	int slowest = receivers[0].acked;
+	int i;
+	for (i = 1; i < receiver_count; i++) {
+		if (receivers[i].acked < slowest)
+			slowest = receivers[i].acked;
+	}
+	return slowest;
+}
+
+void ack_packet(int seq, struct sockaddr* from, socklen_t from_len) {
 	pthread_mutex_lock(&lock);
+
+	struct Receiver* receiver = find_receiver(from, from_len);
+	if (receiver == NULL) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
 	
 	if (seq == -1){
-	    send_close_notification();
-	    usleep(200000);
-	    fin_ack_received = 1;
-	    printf("reliable_sender: received FIN_ACK\n");
+	    if (!receiver->done) {
+	        receiver->done = 1;
+	        receiver->acked = last_seq;
+	        receivers_done++;
+	    }
+	    // Receivers linger until they hear the CLOSE, answer every FIN_ACK
+	    // once nobody is left waiting for data
+	    if (receivers_done == expected_receivers) {
+	        send_close_notification();
+	        if (!fin_ack_received)
+	            printf("reliable_sender: received FIN_ACK\n");
+	        fin_ack_received = 1;
+	        pthread_cond_broadcast(&window_cond);
+	        pthread_cond_signal(&resend_cond);
+	    }
+	    pthread_mutex_unlock(&lock);
 	    return;
 	}  
 
-	int index = map_seq_to_window(seq);
+	// ACKs are cumulative, seq and everything before it is written
+	if (seq >= current_seq) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	acks_received++;
+	if (seq > receiver->acked)
+		receiver->acked = seq;
+
+	long long int now = now_us();
+	seq = slowest_ack();
+	if (seq <= window_start) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
 
-	if (window[index].ack == 0) {
-		struct SlidingWindow entry = window[index];
-		window[index].ack = 1;
-		window[index].seq = 0;
+	// The newest segment ACKed measures the round trip, unless a
+	// retransmission filled a hole before it (Karn)
+	int sample = 1;
+	int acked;
+	for (acked = window_start + 1; acked <= seq; acked++) {
+		if (window[map_seq_to_window(acked)].retransmitted)
+			sample = 0;
+	}
+	if (sample)
+		update_rtt(now - window[map_seq_to_window(seq)].time_sent);
+	last_progress = now;
+	tail_probes = 0;
 
-		int data_size = window[index].size;
-		num_bytes_sent += data_size;
+	// Slide the window over everything covered
+	int slide_value = 0;
+	while (window_start < seq) {
+		window_start++;
+		slide_value++;
+		int index = map_seq_to_window(window_start);
+
+		// The receiver ACKs in order, so the message is delivered in full
+		// unless one of its segments was skipped
+		if (window[index].skipped)
+			message_incomplete = 1;
+		if (window[index].message_start) {
+			if (message_incomplete) {
+				fprintf(stderr, "reliable_sender: message %lld, %s, lost segments past the deadline\n",
+						messages_acked + 1, message_files[messages_acked % message_file_count]);
+				messages_skipped++;
+			} else
+				record_latency(now - window[index].message_start);
+			message_incomplete = 0;
+			messages_acked++;
+		}
 
+		num_bytes_sent += window[index].size;
 		free(window[index].data);
 		window[index].data = NULL;
-	} else {
-		printf("reliable_sender: Duplicate ACK received for seq #%d\n", seq);
+		window[index].seq = 0;
+		window[index].ack = 0;
 	}
-
-	// Slide window as more packets get ack
-	int slide_value = 0;
-	while (window[map_seq_to_window(window_start + 1)].ack
-			&& slide_value < WINDOW_SIZE - 1) {
-		slide_value++;
-		window_start++;
-		window[map_seq_to_window(window_start)].ack = 0; // reseting ack
-		//printf("reliable_sender: window start for seq# %d is set to %d\n", seq, window_start);
+	segments_acked += slide_value;
+
+	// Count segments, not ACKs, a coalesced ACK opens the window as much
+	if (cwnd < ssthresh)
+		cwnd += slide_value;
+	else
+		cwnd += (double) slide_value / cwnd;
+	if (cwnd > WINDOW_SIZE)
+		cwnd = WINDOW_SIZE;
+
+	// Partial ACK while recovering, the next segment sent before it is lost too
+	if (slide_value > 0 && window_start + 1 < recovery_seq
+			&& window_start + 1 > recovery_resent
+			&& window_start + 1 < current_seq) {
+		recovery_resent = window_start + 1;
+		resend_entry(map_seq_to_window(window_start + 1), now_us());
 	}
 
+	if (slide_value > 0)
+		pthread_cond_signal(&window_cond);
+
 	pthread_mutex_unlock(&lock);
 }
 
@@ -353,47 +1705,34 @@ void sendPacket(unsigned char* packet) {
 	send_data(packet, size + HEADER_SIZE);
 }
 
+/*
+*   Sends on the one socket of the transfer to every destination resolved by
+*   establish_send_connection(), with a single sendmmsg for a fan-out list
+*/
 void send_data(void *data, int size){
-    int sockfd;
-    struct addrinfo hints, *servinfo, *p;
-    int rv;
-    int numbytes;
-
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
-
-    if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
-    }
-
-    // loop through all the results and make a socket
-    for(p = servinfo; p != NULL; p = p->ai_next) {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype,
-                p->ai_protocol)) == -1) {
-            perror("reliable_sender: socket");
-            continue;
-        }
-
-        break;
-    }
-
-    if (p == NULL) {
-        fprintf(stderr, "reliable_sender: failed to bind socket\n");
-        return 2;
-    }
+	struct iovec iov;
+	struct mmsghdr messages[MAX_RECEIVERS];
+	int i;
+
+	iov.iov_base = data;
+	iov.iov_len = size;
+	memset(messages, 0, destination_count * sizeof(struct mmsghdr));
+	for (i = 0; i < destination_count; i++) {
+		messages[i].msg_hdr.msg_name = &destinations[i];
+		messages[i].msg_hdr.msg_namelen = destination_lengths[i];
+		messages[i].msg_hdr.msg_iov = &iov;
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
 
-	int sentBytes;
-	if (sockfd) {
-		if ((sentBytes = sendto(sockfd, data, size, 0,
-				p->ai_addr, p->ai_addrlen)) == -1) {
+	int sent = 0;
+	while (sent < destination_count) {
+		int count = sendmmsg(send_socket, messages + sent, destination_count - sent, 0);
+		if (count == -1) {
 			perror("packet send:");
 			exit(1);
 		}
+		sent += count;
 	}
-	
-	close(sockfd);
 }
 
 
@@ -402,28 +1741,88 @@ void *send_data_thread(){
         
 }
 
+/* Dispatches a datagram from a receiver: an ACK, a NAK or a chunk of a reply */
+void handle_ack_message(unsigned char* buf, int numbytes,
+		struct sockaddr* from, socklen_t from_len) {
+	int akc_seq;
+	memcpy(&akc_seq, buf, INT_SIZE);
+	if (akc_seq == SIGNATURE_MSG && numbytes >= SIGNATURE_HEADER_SIZE) {
+		store_signatures(buf, numbytes);
+	} else if (akc_seq == RANGES_MSG && numbytes >= RANGES_HEADER_SIZE) {
+		store_ranges(buf, numbytes);
+	} else if (akc_seq == NAK_MSG && numbytes >= NAK_HEADER_SIZE) {
+		nak_packet(buf, numbytes, from, from_len);
+	} else if (akc_seq == SKIPPED_MSG && numbytes >= SKIPPED_HEADER_SIZE) {
+		skipped_packet(buf, numbytes);
+	} else {
+		ack_packet(akc_seq, from, from_len);
+	}
+}
+
+/*
+*   io_uring flavour of the ACK listener. A single multishot receive keeps
+*   filling the provided buffers, so a burst of ACKs is reaped with one
+*   io_uring_enter instead of a recvfrom each. Returns if the kernel has no
+*   multishot receive after all.
+*/
+void listen_for_ack_ring() {
+	struct RingCompletion completion;
+	ring_recv_multishot(&ack_ring);
+	while (1) {
+		if (ring_submit_and_wait(&ack_ring, 1, -1) == -1) {
+			perror("ack recv");
+			exit(1);
+		}
+		while (ring_next_completion(&ack_ring, &completion)) {
+			unsigned char* buf = ring_buffer(&ack_ring, &completion);
+			if (completion.res > 0 && buf)
+				handle_ack_message(buf, completion.res, NULL, 0);
+			else if (completion.res == -EINVAL) {
+				fprintf(stderr, "reliable_sender: no multishot receive, using recvfrom\n");
+				return;
+			} else if (completion.res < 0 && completion.res != -ENOBUFS) {
+				errno = -completion.res;
+				perror("ack recv");
+				exit(1);
+			}
+			ring_recycle_buffer(&ack_ring, &completion);
+			// Out of buffers or otherwise stopped, start it again
+			if (ring_recv_stopped(&completion))
+				ring_recv_multishot(&ack_ring);
+		}
+	}
+}
+
 void *listen_for_ack(void* data) {
 	printf("listening thread is started ...\n");
-	receive_socket = establish_receive_connection();
+	if (ring_enabled)
+		listen_for_ack_ring();
+
 	struct sockaddr_storage their_addr;
 	socklen_t addr_len = sizeof their_addr;
+	unsigned char* buf = malloc(MAXBUFLEN);
 	while (1) {
-		unsigned char buf[INT_SIZE];
-		int akc_seq;
-		if ((recvfrom(receive_socket, buf, INT_SIZE, 0,
+		int numbytes;
+		if ((numbytes = recvfrom(receive_socket, buf, MAXBUFLEN, 0,
 				(struct sockaddr *) &their_addr, &addr_len)) == -1) {
 			perror("ack recv");
 			exit(1);
 		}
-		memcpy(&akc_seq, buf, INT_SIZE);
-		ack_packet(akc_seq);
+		handle_ack_message(buf, numbytes, (struct sockaddr *) &their_addr, addr_len);
 	}
 }
 
+/*
+*   Resolves the receiver, a comma separated list of receivers or a multicast
+*   group, and opens the socket segments are sent from
+*/
 int establish_send_connection(char* hostname) {
-	int sockfd;
+	int sockfd = -1;
 	int rv;
 	struct addrinfo hints, *servinfo, *p;
+	char* hosts = strdup(hostname);
+	char* next_host = hosts;
+	char* name;
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_DGRAM;
@@ -431,29 +1830,59 @@ int establish_send_connection(char* hostname) {
 	
 	printf("%s\n", hostname);
 
-	if ((rv = getaddrinfo(hostname, port, &hints, &servinfo)) != 0) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-		return 1;
-	}
+	while ((name = strsep(&next_host, ",")) != NULL) {
+		if (destination_count == MAX_RECEIVERS) {
+			fprintf(stderr, "reliable_sender: at most %d receivers\n", MAX_RECEIVERS);
+			exit(1);
+		}
+		if ((rv = getaddrinfo(name, port, &hints, &servinfo)) != 0) {
+			fprintf(stderr, "getaddrinfo: %s: %s\n", name, gai_strerror(rv));
+			exit(1);
+		}
 
-	// loop through all the results and make a socket
-	for (p = servinfo; p != NULL; p = p->ai_next) {
-		if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol))
-				== -1) {
-			perror("talker: socket");
-			continue;
+		// The first receiver decides the family, the others must share it
+		for (p = servinfo; p != NULL; p = p->ai_next) {
+			if (sockfd == -1 && (sockfd = socket(p->ai_family, p->ai_socktype,
+					p->ai_protocol)) == -1) {
+				perror("talker: socket");
+				continue;
+			}
+			if (destination_count == 0 || p->ai_family == destinations[0].ss_family)
+				break;
+		}
+		if (p == NULL) {
+			fprintf(stderr, "talker: failed to bind socket\n");
+			exit(1);
 		}
 
-		break;
+		// Keep our own copy of the address, servinfo owns the original
+		memcpy(&destinations[destination_count], p->ai_addr, p->ai_addrlen);
+		destination_lengths[destination_count++] = p->ai_addrlen;
+		freeaddrinfo(servinfo);
 	}
-	if (p == NULL) {
-		fprintf(stderr, "talker: failed to bind socket\n");
-		return 2;
+	free(hosts);
+
+	if (destination_count > 1)
+		expected_receivers = destination_count;
+
+	struct sockaddr_in* group = (struct sockaddr_in*) &destinations[0];
+	if (destinations[0].ss_family == AF_INET && IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+		// Receivers on this host hear the group too
+		unsigned char loop = 1;
+		setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof loop);
+		if (multicast_if) {
+			struct in_addr interface;
+			if (inet_pton(AF_INET, multicast_if, &interface) != 1
+					|| setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF,
+							&interface, sizeof interface) == -1) {
+				fprintf(stderr, "reliable_sender: bad multicast interface %s\n", multicast_if);
+				exit(1);
+			}
+		}
+	} else if (destination_count == 1 && expected_receivers > 1) {
+		fprintf(stderr, "reliable_sender: -F needs a multicast group or a list of receivers\n");
+		exit(1);
 	}
-	receiver_info = malloc(sizeof *p);
-	*receiver_info = *p;
-	
-	freeaddrinfo(servinfo);
 	
 	return sockfd;
 }
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "helper.h"
+#include "delta.h"
+#include "tune.h"
+
+#define MAX_SIGNATURE_THREADS 8
+
+int delta_block_size(long long file_size) {
+	int block_size = DELTA_MIN_BLOCK;
+	while (block_size < DELTA_MAX_BLOCK
+			&& (long long) block_size * block_size < file_size) {
+		block_size *= 2;
+	}
+	return block_size;
+}
+
+/*
+*   a is the sum of the bytes, b the sum of each byte weighted by its distance
+*   to the end of the block. Both are kept modulo 2^16.
+*/
+uint32_t weak_checksum(const unsigned char* data, size_t size) {
+	uint32_t a = 0;
+	uint32_t b = 0;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	/*
+	*   Over a 16 byte chunk b grows by 16 times the sum so far plus the
+	*   chunk's bytes weighted 16 down to 1, so sums and weighted sums are
+	*   accumulated in vectors and folded together once at the end.
+	*/
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weights_lo = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+	const __m128i weights_hi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+	__m128i sums = zero;
+	__m128i prefix_sums = zero;
+	__m128i weighted = zero;
+
+	for (; i + 16 <= size; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*) (data + i));
+		prefix_sums = _mm_add_epi32(prefix_sums, sums);
+		sums = _mm_add_epi32(sums, _mm_sad_epu8(bytes, zero));
+		weighted = _mm_add_epi32(weighted,
+				_mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), weights_lo));
+		weighted = _mm_add_epi32(weighted,
+				_mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), weights_hi));
+	}
+
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i*) lanes, sums);
+	a = lanes[0] + lanes[2];
+	_mm_storeu_si128((__m128i*) lanes, prefix_sums);
+	b = 16 * (lanes[0] + lanes[2]);
+	_mm_storeu_si128((__m128i*) lanes, weighted);
+	b += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+	for (; i < size; i++) {
+		a += data[i];
+		b += a;
+	}
+
+	return (a & 0xffff) | (b << 16);
+}
+
+uint32_t roll_checksum(uint32_t weak, unsigned char out, unsigned char in, size_t size) {
+	uint32_t a = weak & 0xffff;
+	uint32_t b = weak >> 16;
+
+	a = a - out + in;
+	b = b - size * out + a;
+
+	return (a & 0xffff) | (b << 16);
+}
+
+/* Truncated SHA-256, OpenSSL picks the SHA-NI/AVX2 code path when it can */
+void strong_hash(const unsigned char* data, size_t size, unsigned char* out) {
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	SHA256(data, size, digest);
+	memcpy(out, digest, STRONG_SIZE);
+}
+
+struct SignatureJob {
+	int fd;
+	int block_size;
+	int first_block;
+	int last_block;
+	struct BlockSignature* signatures;
+};
+
+void *signature_worker(void *data) {
+	struct SignatureJob* job = data;
+	unsigned char* block = malloc(job->block_size);
+	int i;
+
+	for (i = job->first_block; i < job->last_block; i++) {
+		off_t offset = (off_t) i * job->block_size;
+		size_t filled = 0;
+		while (filled < job->block_size) {
+			ssize_t count = pread(job->fd, block + filled,
+					job->block_size - filled, offset + filled);
+			if (count <= 0) {
+				perror("signature pread");
+				exit(1);
+			}
+			filled += count;
+		}
+
+		job->signatures[i].weak = weak_checksum(block, job->block_size);
+		strong_hash(block, job->block_size, job->signatures[i].strong);
+	}
+
+	free(block);
+	return NULL;
+}
+
+int compute_signatures(int fd, long long file_size, int block_size,
+		struct BlockSignature** signatures) {
+	int num_blocks = file_size / block_size;
+	*signatures = malloc(sizeof(struct BlockSignature) * (num_blocks + 1));
+
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1)
+		num_threads = 1;
+	if (num_threads > MAX_SIGNATURE_THREADS)
+		num_threads = MAX_SIGNATURE_THREADS;
+
+	pthread_t threads[MAX_SIGNATURE_THREADS];
+	struct SignatureJob jobs[MAX_SIGNATURE_THREADS];
+	int i;
+
+	// Each thread reads a contiguous range so the disk still sees long runs
+	for (i = 0; i < num_threads; i++) {
+		jobs[i].fd = fd;
+		jobs[i].block_size = block_size;
+		jobs[i].first_block = (long long) num_blocks * i / num_threads;
+		jobs[i].last_block = (long long) num_blocks * (i + 1) / num_threads;
+		jobs[i].signatures = *signatures;
+		create_thread(&threads[i], DISK_THREADS, signature_worker, &jobs[i]);
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	return num_blocks;
+}
@@ -0,0 +1,37 @@
+#include <stdint.h>
+
+/* Block signatures of the receiver's existing file for delta transfers */
+#define STRONG_SIZE 16
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK 32768
+/* Most basis blocks a single block reference segment copies */
+#define DELTA_MAX_RUN 1024
+
+/* Signature chunk datagram: marker | chunk | total blocks | block size | count | entries */
+#define SIGNATURE_MSG -2
+#define SIGNATURE_HEADER_SIZE 5*sizeof(int)
+#define SIGNATURE_ENTRY_SIZE (sizeof(uint32_t) + STRONG_SIZE)
+#define SIGNATURES_PER_CHUNK ((DATA_SIZE - SIGNATURE_HEADER_SIZE) / SIGNATURE_ENTRY_SIZE)
+
+struct BlockSignature {
+	uint32_t weak;
+	unsigned char strong[STRONG_SIZE];
+};
+
+/* Picks a block size for a basis file, about its square root like rsync */
+int delta_block_size(long long file_size);
+
+/* rsync rolling checksum of a block, vectorized where SSE2 is available */
+uint32_t weak_checksum(const unsigned char* data, size_t size);
+
+/* Slides the checksum of a size byte block one byte forward */
+uint32_t roll_checksum(uint32_t weak, unsigned char out, unsigned char in, size_t size);
+
+void strong_hash(const unsigned char* data, size_t size, unsigned char* out);
+
+/*
+*   Computes the signature of every full block of fd on several threads.
+*   Returns the number of blocks, the array is malloc'd into *signatures.
+*/
+int compute_signatures(int fd, long long file_size, int block_size,
+		struct BlockSignature** signatures);
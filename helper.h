@@ -16,3 +16,45 @@
 #define DATA_SIZE 60000
 #define MAXBUFLEN 60028
 #define WINDOW_SIZE 20
+/*
+*   Socket buffer for a full window of datagrams. The window caps what is in
+*   flight, so it also bounds the bandwidth-delay product a flow can use.
+*/
+#define WINDOW_BYTES (WINDOW_SIZE * MAXBUFLEN)
+
+/* Data packet layout: seq | payload size | flags | payload */
+#define INT_SIZE sizeof(int)
+#define HEADER_SIZE 3*INT_SIZE
+#define PAYLOAD_SIZE (DATA_SIZE - HEADER_SIZE)
+
+/* Packet flags */
+#define FLAG_EOS 0x1	/* last segment of the stream, carries no payload */
+#define FLAG_COMPRESSED 0x2	/* payload is a zlib stream of the segment */
+#define FLAG_BLOCK_REF 0x4	/* payload is a run of the receiver's blocks: first | count */
+#define FLAG_MSG_START 0x8	/* first segment of a session message: name length | name | data */
+#define FLAG_MSG_END 0x10	/* last segment of a session message */
+#define FLAG_ACK_NOW 0x20	/* the sender is waiting on this segment, don't delay its ACK */
+
+/* ACKs carry the highest seq written, every segment before it is written too */
+
+/*
+*   Received block map of a resumable transfer, one bit per PAYLOAD_SIZE
+*   block of the file: marker | chunk | total blocks | byte count | bitmap
+*/
+#define RANGES_MSG -3
+#define RANGES_HEADER_SIZE 4*INT_SIZE
+#define RANGE_BYTES_PER_CHUNK (DATA_SIZE - RANGES_HEADER_SIZE)
+
+/*
+*   Loss report of a receiver, sent when a segment arrives past a hole:
+*   marker | cumulative ACK | count | missing seqs
+*/
+#define NAK_MSG -4
+#define NAK_HEADER_SIZE 3*INT_SIZE
+
+/* Segments a receiver skipped past the deadline: marker | count | seqs */
+#define SKIPPED_MSG -5
+#define SKIPPED_HEADER_SIZE 2*INT_SIZE
+
+/* Filename standing for stdin (sender) or stdout (receiver) */
+#define STREAM_NAME "-"
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+
+#include "ring.h"
+
+#ifdef HAVE_IO_URING
+
+static int ring_enter(int fd, unsigned to_submit, unsigned wait_nr, unsigned flags,
+		void *arg, size_t arg_size) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, flags, arg, arg_size);
+}
+
+static int ring_register(int fd, unsigned opcode, void *arg, unsigned count) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+int ring_init(struct Ring *ring, int socket) {
+	struct io_uring_params params;
+	memset(ring, 0, sizeof *ring);
+	memset(&params, 0, sizeof params);
+
+	ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	// Timed waits and writes at the current file position are needed
+	unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG
+			| IORING_FEAT_RW_CUR_POS;
+	if ((params.features & needed) != needed) {
+		close(ring->fd);
+		return -1;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes
+			+ params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t size = sq_size > cq_size ? sq_size : cq_size;
+
+	unsigned char *rings = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->entries = params.sq_entries;
+	ring->sq_head = (unsigned *) (rings + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (rings + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (rings + params.sq_off.ring_mask);
+	ring->cq_head = (unsigned *) (rings + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (rings + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (rings + params.cq_off.ring_mask);
+	ring->cqes = rings + params.cq_off.cqes;
+	ring->sq_queued = *ring->sq_tail;
+
+	// Submission slots map one to one onto the entries
+	unsigned *array = (unsigned *) (rings + params.sq_off.array);
+	unsigned i;
+	for (i = 0; i < params.sq_entries; i++)
+		array[i] = i;
+
+	if (ring_register(ring->fd, IORING_REGISTER_FILES, &socket, 1) < 0) {
+		close(ring->fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+*   Multishot receive came in Linux 6.0, a kernel between 5.19 and it takes
+*   the provided buffer ring below but fails the receive itself
+*/
+static int kernel_has_multishot_recv() {
+	struct utsname name;
+	int major;
+	if (uname(&name) == -1 || sscanf(name.release, "%d.", &major) != 1)
+		return 0;
+	return major >= 6;
+}
+
+int ring_provide_buffers(struct Ring *ring, int buffer_size) {
+	if (!kernel_has_multishot_recv())
+		return -1;
+
+	size_t ring_size = RING_BUFFERS * sizeof(struct io_uring_buf);
+	struct io_uring_buf_ring *buf_ring = mmap(NULL, ring_size,
+			PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (buf_ring == MAP_FAILED)
+		return -1;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uint64_t) (uintptr_t) buf_ring;
+	reg.ring_entries = RING_BUFFERS;
+	reg.bgid = 0;
+	if (ring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		munmap(buf_ring, ring_size);
+		return -1;
+	}
+
+	ring->buf_ring = buf_ring;
+	ring->buffer_size = buffer_size;
+	ring->buffers = malloc((size_t) RING_BUFFERS * buffer_size);
+	ring->buf_tail = 0;
+
+	int bid;
+	for (bid = 0; bid < RING_BUFFERS; bid++) {
+		struct io_uring_buf *buf = &buf_ring->bufs[ring->buf_tail & (RING_BUFFERS - 1)];
+		buf->addr = (uint64_t) (uintptr_t) (ring->buffers + (size_t) bid * buffer_size);
+		buf->len = buffer_size;
+		buf->bid = bid;
+		ring->buf_tail++;
+	}
+	__atomic_store_n(&buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Next free submission entry, submitting what is queued if the ring is full */
+static struct io_uring_sqe *ring_get_sqe(struct Ring *ring) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_queued - head >= ring->entries) {
+		if (ring_submit_and_wait(ring, 0, -1) == -1)
+			return NULL;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sq_queued - head >= ring->entries)
+			return NULL;
+	}
+
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *) ring->sqes
+			+ (ring->sq_queued & *ring->sq_mask);
+	memset(sqe, 0, sizeof *sqe);
+	ring->sq_queued++;
+	return sqe;
+}
+
+int ring_recv_multishot(struct Ring *ring) {
+	struct io_uring_sqe *sqe = ring_get_sqe(ring);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = 0;
+	sqe->user_data = RING_RECV;
+	return 0;
+}
+
+int ring_sendmsg(struct Ring *ring, struct msghdr *msg, uint64_t user_data) {
+	struct io_uring_sqe *sqe = ring_get_sqe(ring);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = (uint64_t) (uintptr_t) msg;
+	sqe->len = 1;
+	sqe->user_data = user_data;
+	return 0;
+}
+
+int ring_writev(struct Ring *ring, int fd, struct iovec *iov, int count,
+		uint64_t user_data) {
+	struct io_uring_sqe *sqe = ring_get_sqe(ring);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) iov;
+	sqe->len = count;
+	sqe->off = (uint64_t) -1;
+	sqe->user_data = user_data;
+	return 0;
+}
+
+int ring_submit_and_wait(struct Ring *ring, unsigned wait_nr, long long timeout_us) {
+	// Whatever the kernel hasn't consumed yet, even if an earlier wait timed out
+	unsigned to_submit = ring->sq_queued - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+	void *argp = NULL;
+	size_t arg_size = 0;
+	if (timeout_us >= 0) {
+		ts.tv_sec = timeout_us / 1000000;
+		ts.tv_nsec = (timeout_us % 1000000) * 1000;
+		memset(&arg, 0, sizeof arg);
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+		argp = &arg;
+		arg_size = sizeof arg;
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	}
+
+	while (1) {
+		int ret = ring_enter(ring->fd, to_submit, wait_nr, flags, argp, arg_size);
+		if (ret >= 0)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+int ring_next_completion(struct Ring *ring, struct RingCompletion *completion) {
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	struct io_uring_cqe *cqe = (struct io_uring_cqe *) ring->cqes
+			+ (head & *ring->cq_mask);
+	completion->user_data = cqe->user_data;
+	completion->res = cqe->res;
+	completion->flags = cqe->flags;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+unsigned char *ring_buffer(struct Ring *ring, struct RingCompletion *completion) {
+	if (!(completion->flags & IORING_CQE_F_BUFFER))
+		return NULL;
+	int bid = completion->flags >> IORING_CQE_BUFFER_SHIFT;
+	return ring->buffers + (size_t) bid * ring->buffer_size;
+}
+
+void ring_recycle_buffer(struct Ring *ring, struct RingCompletion *completion) {
+	if (!(completion->flags & IORING_CQE_F_BUFFER))
+		return;
+	struct io_uring_buf_ring *buf_ring = ring->buf_ring;
+	int bid = completion->flags >> IORING_CQE_BUFFER_SHIFT;
+	struct io_uring_buf *buf = &buf_ring->bufs[ring->buf_tail & (RING_BUFFERS - 1)];
+	buf->addr = (uint64_t) (uintptr_t) (ring->buffers + (size_t) bid * ring->buffer_size);
+	buf->len = ring->buffer_size;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+int ring_recv_stopped(struct RingCompletion *completion) {
+	return !(completion->flags & IORING_CQE_F_MORE);
+}
+
+#else
+
+int ring_init(struct Ring *ring, int socket) {
+	return -1;
+}
+
+int ring_provide_buffers(struct Ring *ring, int buffer_size) {
+	return -1;
+}
+
+int ring_recv_multishot(struct Ring *ring) {
+	return -1;
+}
+
+int ring_sendmsg(struct Ring *ring, struct msghdr *msg, uint64_t user_data) {
+	return -1;
+}
+
+int ring_writev(struct Ring *ring, int fd, struct iovec *iov, int count,
+		uint64_t user_data) {
+	return -1;
+}
+
+int ring_submit_and_wait(struct Ring *ring, unsigned wait_nr, long long timeout_us) {
+	return -1;
+}
+
+int ring_next_completion(struct Ring *ring, struct RingCompletion *completion) {
+	return 0;
+}
+
+unsigned char *ring_buffer(struct Ring *ring, struct RingCompletion *completion) {
+	return NULL;
+}
+
+void ring_recycle_buffer(struct Ring *ring, struct RingCompletion *completion) {
+}
+
+int ring_recv_stopped(struct RingCompletion *completion) {
+	return 1;
+}
+
+#endif
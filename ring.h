@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+*   Minimal io_uring wrapper over the raw syscalls, so the build doesn't need
+*   liburing. Without the kernel header, or a kernel with multishot receive
+*   and provided buffer rings, ring_init() fails and the callers stay on the
+*   plain socket calls.
+*/
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+/* Receive buffers handed to the kernel, a power of two */
+#define RING_BUFFERS 64
+#define RING_ENTRIES 64
+
+/* user_data of the multishot receive, other requests use their own tags */
+#define RING_RECV 1
+
+struct Ring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	void *sqes;
+	void *cqes;
+	unsigned sq_queued;
+
+	/* Provided buffers the multishot receive fills, group 0 */
+	void *buf_ring;
+	unsigned char *buffers;
+	int buffer_size;
+	unsigned short buf_tail;
+};
+
+struct RingCompletion {
+	uint64_t user_data;
+	int res;
+	unsigned flags;
+};
+
+/* Sets up a ring and registers socket as fixed file 0. Returns -1 if unavailable. */
+int ring_init(struct Ring *ring, int socket);
+
+/*
+*   Hands RING_BUFFERS receive buffers of buffer_size bytes to the kernel.
+*   Returns -1 if they or the multishot receive filling them are unavailable.
+*/
+int ring_provide_buffers(struct Ring *ring, int buffer_size);
+
+/*
+*   Queues a multishot receive on the fixed socket, re-armed when it stops.
+*   A kernel without it fails the first completion with -EINVAL.
+*/
+int ring_recv_multishot(struct Ring *ring);
+
+/* Queues a sendmsg on the fixed socket, msg must live until it completes */
+int ring_sendmsg(struct Ring *ring, struct msghdr *msg, uint64_t user_data);
+
+/* Queues a writev at fd's current position, iov must live until it completes */
+int ring_writev(struct Ring *ring, int fd, struct iovec *iov, int count,
+		uint64_t user_data);
+
+/*
+*   Submits what was queued and waits for wait_nr completions, or timeout_us
+*   when it isn't negative. Returns -1 with errno ETIME on timeout.
+*/
+int ring_submit_and_wait(struct Ring *ring, unsigned wait_nr, long long timeout_us);
+
+/* Takes the next completion, 0 when there is none */
+int ring_next_completion(struct Ring *ring, struct RingCompletion *completion);
+
+/* Buffer a receive completion was written into, or NULL */
+unsigned char *ring_buffer(struct Ring *ring, struct RingCompletion *completion);
+
+/* Gives a receive buffer back to the kernel once its data was handled */
+void ring_recycle_buffer(struct Ring *ring, struct RingCompletion *completion);
+
+/* Returns 1 if a multishot receive completion ended it and it needs re-arming */
+int ring_recv_stopped(struct RingCompletion *completion);
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "tune.h"
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+/* CPUs of each thread group, empty when left to the scheduler */
+static cpu_set_t group_cpus[2];
+static int group_pinned[2];
+
+void tune_socket_buffer(int sockfd, int option, int bytes, const char *program) {
+	const char *name = option == SO_RCVBUF ? "SO_RCVBUF" : "SO_SNDBUF";
+	const char *sysctl = option == SO_RCVBUF ? "net.core.rmem_max" : "net.core.wmem_max";
+	int force = option == SO_RCVBUF ? SO_RCVBUFFORCE : SO_SNDBUFFORCE;
+
+	if (setsockopt(sockfd, SOL_SOCKET, option, &bytes, sizeof bytes) == -1) {
+		perror("setsockopt");
+		return;
+	}
+
+	// The kernel doubles the request to account for its own overhead
+	int granted;
+	socklen_t length = sizeof granted;
+	getsockopt(sockfd, SOL_SOCKET, option, &granted, &length);
+	if (granted >= 2 * bytes)
+		return;
+
+	// Capped by the sysctl, which doesn't bind CAP_NET_ADMIN
+	if (setsockopt(sockfd, SOL_SOCKET, force, &bytes, sizeof bytes) == 0) {
+		getsockopt(sockfd, SOL_SOCKET, option, &granted, &length);
+		if (granted >= 2 * bytes)
+			return;
+	}
+	fprintf(stderr, "%s: kernel capped %s at %d bytes of the %d wanted, raise %s\n",
+			program, name, granted, 2 * bytes, sysctl);
+}
+
+void tune_busy_poll(int sockfd, const char *program) {
+	int usec = BUSY_POLL_USEC;
+	int prefer = 1;
+	int budget = BUSY_POLL_BUDGET;
+
+	// Raising it past net.core.busy_read takes CAP_NET_ADMIN
+	if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec) == -1) {
+		fprintf(stderr, "%s: SO_BUSY_POLL: %s\n", program, strerror(errno));
+		return;
+	}
+	// Added in Linux 5.11, older kernels still busy poll without them
+	if (setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof prefer) == -1
+			|| setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof budget) == -1) {
+		fprintf(stderr, "%s: SO_PREFER_BUSY_POLL: %s\n", program, strerror(errno));
+	}
+}
+
+/* Adds the CPUs of a list like "0-3,8" to set, returns -1 if malformed */
+static int parse_cpu_list(const char *list, cpu_set_t *set) {
+	const char *p = list;
+	while (*p && *p != '\n') {
+		char *end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		if (end == p || first < 0)
+			return -1;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first)
+				return -1;
+			p = end;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		if (*p == ',')
+			p++;
+		else if (*p && *p != '\n')
+			return -1;
+	}
+	return 0;
+}
+
+void set_thread_cpus(int group, const char *spec, const char *program) {
+	char list[4096];
+	const char *cpus = spec;
+
+	// A NUMA node stands for the CPUs sysfs lists for it
+	if (strncmp(spec, "node", 4) == 0) {
+		char path[64];
+		snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", atoi(spec + 4));
+		FILE *f = fopen(path, "r");
+		if (f == NULL || fgets(list, sizeof list, f) == NULL) {
+			fprintf(stderr, "%s: no such NUMA node '%s'\n", program, spec);
+			exit(1);
+		}
+		fclose(f);
+		cpus = list;
+	}
+
+	CPU_ZERO(&group_cpus[group]);
+	if (parse_cpu_list(cpus, &group_cpus[group]) == -1 || CPU_COUNT(&group_cpus[group]) == 0) {
+		fprintf(stderr, "%s: bad CPU list '%s'\n", program, spec);
+		exit(1);
+	}
+	group_pinned[group] = 1;
+}
+
+int create_thread(pthread_t *thread, int group, void *(*start)(void *), void *arg) {
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (group_pinned[group])
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &group_cpus[group]);
+	int ret = pthread_create(thread, &attr, start, arg);
+	pthread_attr_destroy(&attr);
+	return ret;
+}
+
+void pin_current_thread(int group) {
+	if (group_pinned[group])
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &group_cpus[group]);
+}
@@ -0,0 +1,31 @@
+#include <pthread.h>
+
+/* Thread groups that can be pinned to their own CPUs */
+#define NET_THREADS 0
+#define DISK_THREADS 1
+
+/* Busy poll time of the low latency mode, in microseconds */
+#define BUSY_POLL_USEC 50
+#define BUSY_POLL_BUDGET 64
+
+/*
+*   Asks for a SO_RCVBUF or SO_SNDBUF holding bytes of datagrams. Falls back
+*   to the privileged variant when net.core.[rw]mem_max caps it, and reports
+*   what the kernel granted if that still falls short.
+*/
+void tune_socket_buffer(int sockfd, int option, int bytes, const char *program);
+
+/* Low latency mode: busy poll the device queue before sleeping in a receive */
+void tune_busy_poll(int sockfd, const char *program);
+
+/*
+*   Pins a thread group to a CPU list like "0-3,8" or to the CPUs of a NUMA
+*   node given as "node1". Exits on a malformed list.
+*/
+void set_thread_cpus(int group, const char *spec, const char *program);
+
+/* pthread_create() pinned to the group's CPUs when they were set */
+int create_thread(pthread_t *thread, int group, void *(*start)(void *), void *arg);
+
+/* Pins the calling thread to the group's CPUs when they were set */
+void pin_current_thread(int group);